@@ -7,24 +7,110 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
 #include "ps3eye.h"
 
 using namespace cv;
 using namespace std;
 
+extern "C" {
+#include "capture.h"
+}
+
+typedef struct CaptureFrame {
+  uint8_t *buf;
+  Mat *gray;
+  ps3eye::PS3EYECam::FrameInfo info;
+} CaptureFrame;
+
+typedef struct CaptureDetector {
+  CascadeClassifier *cascade;
+} CaptureDetector;
+
+// Follows faces from frame to frame by matching the pixels of each one, as cut out of the frame it was last detected
+// in, against a window around where it was last seen
+typedef struct CaptureTracker {
+  struct Capture *c;
+  vector<Rect> boxes;        // detection coordinates
+  vector<Mat> templates;
+  // newest detection, picked up by the next captureTrack
+  pthread_mutex_t seedMutex;
+  bool seeded;
+  uint64_t seedArrival;
+  vector<Rect> seedBoxes;
+  vector<Mat> seedTemplates;
+} CaptureTracker;
+
 typedef struct Capture {
+  char id[CAPTURE_ID_LENGTH];
   ps3eye::PS3EYECam *device;
-  CascadeClassifier *cascade;
-  uint8_t *buf;
-  Mat *bgr;
+  // used by capture(), the stages bring their own
+  CaptureDetector *detector;
+  CaptureFrame *frame;
+  // latest frame and its faces, handed from the detecting threads to whoever calls captureShow; NULL when headless
+  pthread_mutex_t previewMutex;
+  Mat *preview;
+  Rect previewFaces[CAPTURE_MAX_FACES];
+  int numPreviewFaces;
+  int previewFresh;
+  uint64_t lastPreview;
+  // what captureShow draws on, only touched by that thread
+  Mat *shown;
+  // ROI search: the largest face of the newest detection, shared by the detecting threads
+  pthread_mutex_t roiMutex;
+  int roiInterval;             // ROI detections between full frame scans, 0 to always scan the full frame
+  int roiScans;                // ROI detections since the last full frame scan
+  int haveRoi;
+  Rect roiBox;
+  uint64_t roiArrival;
+  CaptureDetectStats detectStats;
 } Capture;
 
 #define FPS 187
+#define CASCADE_PATH "/usr/local/Cellar/opencv/4.1.2/share/opencv4/haarcascades/haarcascade_frontalface_default.xml"
+// Cap on how often frames are handed to the preview, so the copy costs the capture thread next to nothing
+#define PREVIEW_INTERVAL_MICROS 33333
+// Detection runs on the half resolution luma plane, scale the results back up by this
+#define DETECT_SCALE 2
+// A tracked face is searched for in its box grown by its size / TRACK_MARGIN on every side, and counts as lost when
+// the best match there scores below TRACK_MIN_SCORE (normalized correlation)
+#define TRACK_MARGIN 2
+#define TRACK_MIN_SCORE 0.6
+// An ROI detection searches the last face's box grown by its size / ROI_MARGIN on every side, for faces between
+// 1 / ROI_SCALE_RANGE and ROI_SCALE_RANGE times its size
+#define ROI_MARGIN 1
+#define ROI_SCALE_RANGE 1.5
 
 extern "C" {
-#include "capture.h"
 
-Capture* captureInit() {
+struct libusb_context* captureUSBContext() {
+  return ps3eye::PS3EYECam::getUSBContext();
+}
+
+int captureList(char ids[][CAPTURE_ID_LENGTH], int maxIds) {
+  const auto eyeDevices = ps3eye::PS3EYECam::getDevices();
+
+  // sorted by port path, so the same camera gets the same index as long as nothing is replugged elsewhere
+  vector<string> found;
+  for (const auto &device : eyeDevices) {
+    char id[CAPTURE_ID_LENGTH];
+    if (device->getUSBPortPath(id, sizeof(id))) {
+      found.push_back(id);
+    }
+  }
+  sort(found.begin(), found.end());
+
+  int count = std::min((int) found.size(), maxIds);
+  for (int i = 0; i < count; i++) {
+    snprintf(ids[i], CAPTURE_ID_LENGTH, "%s", found[i].c_str());
+  }
+  return count;
+}
+
+Capture* captureInit(const char *id, int preview) {
 
   Capture *c = (Capture *) malloc(sizeof(Capture));
   if (c == NULL) {
@@ -34,23 +120,61 @@ Capture* captureInit() {
 
   const auto eyeDevices = ps3eye::PS3EYECam::getDevices();
 
-  c->device = eyeDevices.front().get();
-  c->device->init(CAPTURE_WIDTH, CAPTURE_HEIGHT, FPS, ps3eye::PS3EYECam::EOutputFormat::BGR);
+  c->device = NULL;
+  for (const auto &device : eyeDevices) {
+    char deviceId[CAPTURE_ID_LENGTH];
+    if (device->getUSBPortPath(deviceId, sizeof(deviceId)) && strcmp(deviceId, id) == 0) {
+      c->device = device.get();
+      break;
+    }
+  }
+  if (c->device == NULL) {
+    printf("camera %s not found\n", id);
+    exit(-1);
+  }
+  snprintf(c->id, sizeof(c->id), "%s", id);
+
+  c->device->init(CAPTURE_WIDTH, CAPTURE_HEIGHT, FPS, ps3eye::PS3EYECam::EOutputFormat::HalfGray);
   c->device->setAutogain(true);
+  // detection is much slower than the camera, only copy frames we are going to look at
+  c->device->setDecimation(1, true);
   c->device->start();
 
-  // BGR: destination buffer must be width * height bytes * 3
-  size_t bufSize = CAPTURE_WIDTH * CAPTURE_HEIGHT * sizeof(uint8_t) * c->device->getOutputBytesPerPixel();
-  c->buf = (uint8_t*)malloc(bufSize);
-  c->bgr = new Mat(CAPTURE_HEIGHT, CAPTURE_WIDTH, CV_8UC3, c->buf);
-
-  CascadeClassifier *cascade = new CascadeClassifier();
-  cascade->load("/usr/local/Cellar/opencv/4.1.2/share/opencv4/haarcascades/haarcascade_frontalface_default.xml");
-  c->cascade = cascade;
+  c->detector = NULL;
+  c->frame = captureFrameAlloc(c);
+  c->preview = preview ? new Mat() : NULL;
+  c->numPreviewFaces = 0;
+  c->previewFresh = 0;
+  c->lastPreview = 0;
+  c->shown = preview ? new Mat() : NULL;
+  pthread_mutex_init(&c->previewMutex, NULL);
+  pthread_mutex_init(&c->roiMutex, NULL);
+  c->roiInterval = 0;
+  c->roiScans = 0;
+  c->haveRoi = 0;
+  c->roiArrival = 0;
+  memset(&c->detectStats, 0, sizeof(c->detectStats));
 
   return c;
 }
 
+CaptureDetector* captureDetectorInit(Capture *c) {
+  CaptureDetector *d = (CaptureDetector *) malloc(sizeof(CaptureDetector));
+  if (d == NULL) {
+    printf("malloc failed");
+    exit(-1);
+  }
+
+  // CascadeClassifier keeps scratch state per call, so every detecting thread needs its own
+  d->cascade = new CascadeClassifier();
+  d->cascade->load(CASCADE_PATH);
+  return d;
+}
+
+void captureDisableDetectThreads() {
+  setNumThreads(0);
+}
+
 uint64_t now1() {
   struct timespec ts;
   clock_gettime(CLOCK_MONOTONIC, &ts);
@@ -58,39 +182,277 @@ uint64_t now1() {
   return millis;
 }
 
-void capture(Capture *c, CaptureResults *results) {
-//  uint64_t start = now1();
+CaptureFrame* captureFrameAlloc(Capture *c) {
+  CaptureFrame *frame = (CaptureFrame *) malloc(sizeof(CaptureFrame));
+  if (frame == NULL) {
+    printf("malloc failed");
+    exit(-1);
+  }
+
+  // HalfGray: destination buffer must be width/2 * height/2 bytes
+  size_t bufSize = c->device->getOutputHeight() * c->device->getRowBytes();
+  frame->buf = (uint8_t*)malloc(bufSize);
+  frame->gray = new Mat(c->device->getOutputHeight(), c->device->getOutputWidth(), CV_8UC1, frame->buf);
+  return frame;
+}
+
+int captureGrab(Capture *c, CaptureFrame *frame) {
+  // Grayscale straight from the Bayer quads, no full resolution debayer or cvtColor
+  if (!c->device->getFrame(frame->buf, &frame->info)) {
+    // unplugged; the driver brings it back when it shows up on the same port again
+    return -1;
+  }
+  return 0;
+}
+
+// Drawing happens in captureShow. If it, or another detecting thread, holds the lock this frame is skipped rather
+// than waiting. Frames can finish out of order with several detectors, so older ones are skipped too.
+static void handPreview(Capture *c, CaptureFrame *frame, const vector<Rect> &faces, int numFaces) {
+  if (c->preview != NULL && pthread_mutex_trylock(&c->previewMutex) == 0) {
+    if (frame->info.arrival >= c->lastPreview + PREVIEW_INTERVAL_MICROS) {
+      frame->gray->copyTo(*c->preview);
+      for (int i = 0; i < numFaces; i++) {
+        c->previewFaces[i] = faces[i];
+      }
+      c->numPreviewFaces = numFaces;
+      c->previewFresh = 1;
+      c->lastPreview = frame->info.arrival;
+    }
+    pthread_mutex_unlock(&c->previewMutex);
+  }
+}
+
+static void fillResults(CaptureFrame *frame, const vector<Rect> &faces, int numFaces, CaptureResults *results) {
+  results->frameArrival = frame->info.arrival;
+  results->framePts = frame->info.pts;
+
+  // Results are in CAPTURE_WIDTH x CAPTURE_HEIGHT coordinates
+  results->numFaces = numFaces;
+  for (int i = 0; i < numFaces; i++) {
+    results->faces[i].x = faces.at(i).x * DETECT_SCALE;
+    results->faces[i].y = faces.at(i).y * DETECT_SCALE;
+    results->faces[i].width = faces.at(i).width * DETECT_SCALE;
+    results->faces[i].height = faces.at(i).height * DETECT_SCALE;
+  }
+}
 
-  c->device->getFrame(c->buf);
+void captureSetRoiSearch(Capture *c, int fullScanInterval) {
+  pthread_mutex_lock(&c->roiMutex);
+  c->roiInterval = fullScanInterval > 0 ? fullScanInterval : 0;
+  c->roiScans = 0;
+  pthread_mutex_unlock(&c->roiMutex);
+}
 
-  Mat gray;
-  cvtColor(*c->bgr, gray, COLOR_BGR2GRAY); // Convert to Gray Scale
+void captureGetDetectStats(Capture *c, CaptureDetectStats *stats) {
+  pthread_mutex_lock(&c->roiMutex);
+  *stats = c->detectStats;
+  pthread_mutex_unlock(&c->roiMutex);
+}
 
+static uint64_t elapsedMicros(chrono::steady_clock::time_point since) {
+  return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - since).count();
+}
+
+// Detects in a window around the last face only, at scales close to its size; returns false if it isn't there
+static bool detectRoi(CaptureDetector *detector, const Mat &gray, Rect last, vector<Rect> &faces) {
+  int marginX = last.width / ROI_MARGIN, marginY = last.height / ROI_MARGIN;
+  Rect window = Rect(last.x - marginX, last.y - marginY, last.width + marginX * 2, last.height + marginY * 2)
+              & Rect(0, 0, gray.cols, gray.rows);
+  Size minSize((int) (last.width / ROI_SCALE_RANGE), (int) (last.height / ROI_SCALE_RANGE));
+  Size maxSize((int) (last.width * ROI_SCALE_RANGE), (int) (last.height * ROI_SCALE_RANGE));
+
+  detector->cascade->detectMultiScale(gray(window), faces, 1.2, 3, 0, minSize, maxSize);
+  for (size_t i = 0; i < faces.size(); i++) {
+    faces[i].x += window.x;
+    faces[i].y += window.y;
+  }
+  return !faces.empty();
+}
+
+void captureDetect(Capture *c, CaptureDetector *detector, CaptureFrame *frame, CaptureResults *results) {
+  pthread_mutex_lock(&c->roiMutex);
+  bool roi = c->roiInterval > 0 && c->haveRoi && c->roiScans < c->roiInterval;
+  Rect last = c->roiBox;
+  pthread_mutex_unlock(&c->roiMutex);
+
+  // falls back to the full frame when the face isn't near where it was
   vector<Rect> faces;
-  c->cascade->detectMultiScale(gray, faces, 1.2, 3);
+  bool missed = false;
+  uint64_t roiMicros = 0;
+  auto started = chrono::steady_clock::now();
+  if (roi) {
+    missed = !detectRoi(detector, *frame->gray, last, faces);
+    roiMicros = elapsedMicros(started);
+    started = chrono::steady_clock::now();
+  }
+  bool full = !roi || missed;
+  if (full) {
+    detector->cascade->detectMultiScale(*frame->gray, faces, 1.2, 3);
+  }
+  uint64_t fullMicros = full ? elapsedMicros(started) : 0;
+  int numFaces = std::min((int) faces.size(), CAPTURE_MAX_FACES);
 
-  for (int i = 0; i < std::min((int) faces.size(), 10); i++) {
-    Rect f = faces[i];
-    rectangle(*c->bgr, Point(f.x, f.y), Point(f.x + f.width, f.y + f.height), (255, 0, 0), 2);
+  pthread_mutex_lock(&c->roiMutex);
+  if (roi) {
+    c->detectStats.roiScans++;
+    c->detectStats.roiMicros += roiMicros;
+    c->detectStats.roiMisses += missed;
   }
+  if (full) {
+    c->detectStats.fullScans++;
+    c->detectStats.fullMicros += fullMicros;
+  }
+  // several detectors can finish out of order, only the newest frame moves the ROI
+  if (frame->info.arrival > c->roiArrival) {
+    c->roiArrival = frame->info.arrival;
+    c->roiScans = full ? 0 : c->roiScans + 1;
+    c->haveRoi = numFaces > 0;
+    for (int i = 0; i < numFaces; i++) {
+      // the core follows the largest face, so that's the one to look for next time
+      if (i == 0 || faces[i].width > c->roiBox.width) {
+        c->roiBox = faces[i];
+      }
+    }
+  }
+  pthread_mutex_unlock(&c->roiMutex);
+
+  fillResults(frame, faces, numFaces, results);
+  handPreview(c, frame, faces, numFaces);
+}
+
+void captureFrameCopy(CaptureFrame *dest, CaptureFrame *src) {
+  src->gray->copyTo(*dest->gray);
+  dest->info = src->info;
+}
 
-  int centerX = CAPTURE_WIDTH / 2;
-  int centerY = CAPTURE_HEIGHT / 2;
-  circle(*c->bgr, Point(centerX, centerY), CAPTURE_CIRCLE_RADIUS, (255, 0, 0), 2);
+CaptureTracker* captureTrackerInit(Capture *c) {
+  CaptureTracker *t = new CaptureTracker();
+  t->c = c;
+  pthread_mutex_init(&t->seedMutex, NULL);
+  t->seeded = false;
+  t->seedArrival = 0;
+  return t;
+}
+
+void captureTrackerSeed(CaptureTracker *t, CaptureFrame *frame, const CaptureResults *results) {
+  // cut the templates out before taking the lock, the tracker only waits for the swap
+  vector<Rect> boxes;
+  vector<Mat> templates;
+  for (int i = 0; i < results->numFaces; i++) {
+    Rect box(results->faces[i].x / DETECT_SCALE, results->faces[i].y / DETECT_SCALE,
+             results->faces[i].width / DETECT_SCALE, results->faces[i].height / DETECT_SCALE);
+    boxes.push_back(box);
+    templates.push_back((*frame->gray)(box).clone());
+  }
+
+  pthread_mutex_lock(&t->seedMutex);
+  // several detectors can finish out of order, an older detection never replaces a newer one
+  if (frame->info.arrival > t->seedArrival) {
+    t->seedBoxes.swap(boxes);
+    t->seedTemplates.swap(templates);
+    t->seedArrival = frame->info.arrival;
+    t->seeded = true;
+  }
+  pthread_mutex_unlock(&t->seedMutex);
+}
 
-  results->numFaces = faces.size();
-  for (int i = 0; i < faces.size(); i++) {
-    results->faces[i].x = faces.at(i).x;
-    results->faces[i].y = faces.at(i).y;
-    results->faces[i].width = faces.at(i).width;
-    results->faces[i].height = faces.at(i).height;
+int captureTrack(CaptureTracker *t, CaptureFrame *frame, CaptureResults *results) {
+  pthread_mutex_lock(&t->seedMutex);
+  if (t->seeded) {
+    t->boxes.swap(t->seedBoxes);
+    t->templates.swap(t->seedTemplates);
+    t->seeded = false;
   }
+  pthread_mutex_unlock(&t->seedMutex);
 
-  imshow("Live", *c->bgr);
-  waitKey(1);
+  Mat &gray = *frame->gray;
+  Rect bounds(0, 0, gray.cols, gray.rows);
+  Mat scores;
+
+  size_t kept = 0;
+  for (size_t i = 0; i < t->boxes.size(); i++) {
+    Rect box = t->boxes[i];
+    int marginX = box.width / TRACK_MARGIN, marginY = box.height / TRACK_MARGIN;
+    Rect search = Rect(box.x - marginX, box.y - marginY, box.width + marginX * 2, box.height + marginY * 2) & bounds;
+    if (search.width < box.width || search.height < box.height) {
+      continue;
+    }
+
+    double best;
+    Point where;
+    matchTemplate(gray(search), t->templates[i], scores, TM_CCOEFF_NORMED);
+    minMaxLoc(scores, NULL, &best, NULL, &where);
+    if (best < TRACK_MIN_SCORE) {
+      continue;
+    }
+
+    // the template stays the one from the detection, so errors don't add up between detections
+    t->boxes[kept] = Rect(search.x + where.x, search.y + where.y, box.width, box.height);
+    if (kept != i) {
+      t->templates[kept] = t->templates[i];
+    }
+    kept++;
+  }
+  t->boxes.resize(kept);
+  t->templates.resize(kept);
+
+  int numFaces = std::min((int) kept, CAPTURE_MAX_FACES);
+  fillResults(frame, t->boxes, numFaces, results);
+  handPreview(t->c, frame, t->boxes, numFaces);
+  return numFaces;
+}
+
+int capture(Capture *c, CaptureResults *results) {
+//  uint64_t start = now1();
+
+  if (captureGrab(c, c->frame) != 0) {
+    return -1;
+  }
+  if (c->detector == NULL) {
+    c->detector = captureDetectorInit(c);
+  }
+  captureDetect(c, c->detector, c->frame, results);
 
 //  uint64_t end = now1();
 //  printf("capture and recognize: %" PRIu64 "ms\n", end - start);
+  return 0;
+}
+
+void captureShow(Capture *c) {
+  if (c->preview == NULL) {
+    return;
+  }
+
+  // only hold the lock for the copy, the capture thread skips handing over frames while it is taken
+  Rect faces[CAPTURE_MAX_FACES];
+  int numFaces;
+  pthread_mutex_lock(&c->previewMutex);
+  if (!c->previewFresh) {
+    pthread_mutex_unlock(&c->previewMutex);
+    return;
+  }
+  c->preview->copyTo(*c->shown);
+  numFaces = c->numPreviewFaces;
+  for (int i = 0; i < numFaces; i++) {
+    faces[i] = c->previewFaces[i];
+  }
+  c->previewFresh = 0;
+  pthread_mutex_unlock(&c->previewMutex);
+
+  for (int i = 0; i < numFaces; i++) {
+    Rect f = faces[i];
+    rectangle(*c->shown, Point(f.x, f.y), Point(f.x + f.width, f.y + f.height), (255, 0, 0), 2);
+  }
+
+  int centerX = CAPTURE_WIDTH / 2 / DETECT_SCALE;
+  int centerY = CAPTURE_HEIGHT / 2 / DETECT_SCALE;
+  circle(*c->shown, Point(centerX, centerY), CAPTURE_CIRCLE_RADIUS / DETECT_SCALE, (255, 0, 0), 2);
+
+  imshow(string("Live ") + c->id, *c->shown);
+}
+
+void captureWait(int millis) {
+  waitKey(millis);
 }
 
 void captureCleanup(Capture *c) {
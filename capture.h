@@ -1,21 +1,89 @@
+#ifndef THUNDER_CAPTURE_H
+#define THUNDER_CAPTURE_H
+
 #include <stdint.h>
 
 #define CAPTURE_MAX_FACES 10
 #define CAPTURE_CIRCLE_RADIUS 30
 #define CAPTURE_WIDTH 320
 #define CAPTURE_HEIGHT 240
+#define CAPTURE_MAX_CAMERAS 4
+#define CAPTURE_ID_LENGTH 32
 
 typedef struct Capture* Capture_t;
+typedef struct CaptureFrame* CaptureFrame_t;
+typedef struct CaptureDetector* CaptureDetector_t;
+typedef struct CaptureTracker* CaptureTracker_t;
 
 typedef struct CaptureFace {
   int x, y, width, height;
 } CaptureFace;
 
 typedef struct CaptureResults {
+  uint64_t frameArrival; // monotonic time the frame started arriving from the camera, microseconds (see nowMicros)
+  uint32_t framePts;     // camera presentation timestamp, bridge clock ticks
   uint16_t numFaces;
   CaptureFace faces[CAPTURE_MAX_FACES];
 } CaptureResults;
 
-Capture_t captureInit();
-void capture(Capture_t c, CaptureResults *results);
+struct libusb_context;
+
+// libusb context of the camera driver, to share its event handling with other devices
+struct libusb_context* captureUSBContext();
+
+// fills ids with the USB port paths of the connected cameras, in a stable order, and returns how many there are
+int captureList(char ids[][CAPTURE_ID_LENGTH], int maxIds);
+
+// one Capture per camera, each can be driven from its own thread. With preview 0 (headless) nothing is drawn and
+// captureShow does nothing.
+Capture_t captureInit(const char *id, int preview);
+// returns 0, or -1 without results while the camera is disconnected
+int capture(Capture_t c, CaptureResults *results);
+
+// capture() in two steps, for running them on different threads: captureGrab waits for the next frame from the
+// camera (already converted to the detector's grayscale), captureDetect finds the faces in it. Frames can be handed
+// between them, as long as only one uses a frame at a time. Detection can run on several threads at once, on
+// different frames, with a detector each.
+CaptureFrame_t captureFrameAlloc(Capture_t c);
+CaptureDetector_t captureDetectorInit(Capture_t c);
+// returns 0, or -1 while the camera is disconnected
+int captureGrab(Capture_t c, CaptureFrame_t frame);
+void captureDetect(Capture_t c, CaptureDetector_t detector, CaptureFrame_t frame, CaptureResults *results);
+
+// Cheap frame to frame tracking, to run full detection only every few frames. captureTrackerSeed hands the faces
+// captureDetect found in a frame to the tracker, from any thread; the next captureTrack starts following them
+// unless a newer frame was seeded already. captureTrack follows the faces into a newer frame on the tracker's own
+// thread, fills results like captureDetect and returns how many are still in view; detection should run again
+// when that drops to 0.
+CaptureTracker_t captureTrackerInit(Capture_t c);
+void captureTrackerSeed(CaptureTracker_t t, CaptureFrame_t frame, const CaptureResults *results);
+int captureTrack(CaptureTracker_t t, CaptureFrame_t frame, CaptureResults *results);
+// for handing a frame to another thread while keeping it
+void captureFrameCopy(CaptureFrame_t dest, CaptureFrame_t src);
+
+// ROI search: while there is a face, detect only in a window around the largest one from the newest detection, at
+// sizes close to it, and scan the full frame after fullScanInterval such detections or when the face isn't found.
+// Other faces are only picked up by the full scans. 0 (the default) always scans the full frame.
+void captureSetRoiSearch(Capture_t c, int fullScanInterval);
+
+// time spent in detection, over all of a Capture's detectors; an ROI miss counts as an ROI scan plus a full scan
+typedef struct CaptureDetectStats {
+  uint64_t fullScans, fullMicros;
+  uint64_t roiScans, roiMicros;
+  uint64_t roiMisses;
+} CaptureDetectStats;
+
+void captureGetDetectStats(Capture_t c, CaptureDetectStats *stats);
+
+// OpenCV spreads each detection over its own thread pool. Once several detectors work on different frames that only
+// oversubscribes the cores, so this turns it off for the whole process.
+void captureDisableDetectThreads();
+
+// preview windows; HighGUI wants these on the main thread. Frames are handed over at up to ~30 fps and drawn here,
+// so a slow GUI never holds up capture().
+void captureShow(Capture_t c);
+void captureWait(int millis);
+
 void captureCleanup(Capture_t c);
+
+#endif //THUNDER_CAPTURE_H
@@ -6,6 +6,7 @@
 #include <math.h>
 #include <sys/time.h>
 #include <errno.h>
+#include <string.h>
 
 #include "errors.h"
 #include "core.h"
@@ -38,6 +39,14 @@ uint64_t now() {
   return millis;
 }
 
+// same clock as now(), and as the frame arrival times reported by the camera
+uint64_t nowMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t micros = ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  return micros;
+}
+
 typedef enum {
   LED_OFF,
   LED_ON,
@@ -385,12 +394,23 @@ bool isInside(int circle_x, int circle_y, int rad, int x, int y) {
  * solid red when sentry has a face in its sights
  */
 
+// the camera mounted on the turret; any others only widen what the sentry can see
+#define PRIMARY_CAMERA 0
+
 void handleFace(Core *core, FaceEvent e) {
 
   if (core->sentryMode == SENTRY_MODE_OFF) {
     return;
   }
 
+  if (e.cameraId != PRIMARY_CAMERA) {
+    // aiming needs the view down the barrel; don't let another camera's empty frames stop tracking either
+    if (e.numFaces > 0) {
+      printf("sentry: camera %u sees %u face(s)\n", e.cameraId, e.numFaces);
+    }
+    return;
+  }
+
   if (e.numFaces == 0) {
     setLedMode(core, LED_BLINK_SLOW);
     if (core->trackingFace) {
@@ -446,6 +466,7 @@ void handleFace(Core *core, FaceEvent e) {
         move(core, MOVE_NONE);
         core->moving = false;
         if (core->sentryMode == SENTRY_MODE_ARMED) {
+          printf("sentry: firing (%" PRIu64 "us after capture)\n", nowMicros() - e.whenCaptured);
           beginFiring(core);
         }
       }
@@ -461,7 +482,7 @@ void handleFace(Core *core, FaceEvent e) {
         move(core, MOVE_NONE);
         core->moving = false;
         if (core->sentryMode == SENTRY_MODE_ARMED) {
-          printf("sentry: firing\n");
+          printf("sentry: firing (%" PRIu64 "us after capture)\n", nowMicros() - e.whenCaptured);
           beginFiring(core);
         }
       }
@@ -560,7 +581,8 @@ void printEvent(Event e) {
       }
       break;
     case E_FACE:
-      printf("{\"type\": \"face\",  \"whenOccurred\": \"%" PRIu64 "\"}\n", e.whenOccurred);
+      printf("{\"type\": \"face\",  \"whenOccurred\": \"%" PRIu64 "\", \"camera\": \"%u\", \"whenCaptured\": \"%" PRIu64 "\", \"framePts\": \"%" PRIu32 "\"}\n",
+             e.whenOccurred, e.face.cameraId, e.face.whenCaptured, e.face.framePts);
       break;
     default:
     explode("unknown event type: %u\n", e.type);
@@ -588,9 +610,31 @@ bool send(Core *core, Event e) {
   return true;
 }
 
-int main() {
+#define PREVIEW_INTERVAL 10 // ms
+
+int main(int argc, char **argv) {
+
+  // --headless: no preview windows, and the capture threads skip all drawing
+  // --detectors n: detection threads per camera, by default the cores left over are shared between the cameras
+  // --track n: follow faces with a tracker, running full detection every n frames or when it loses them
+  // --roi n: detect around the last face only, scanning the full frame every n detections or when it's gone
+  FaceCaptureOptions options = { .preview = 1, .detectors = 0, .trackInterval = 0, .roiInterval = 0 };
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "--headless") == 0) {
+      options.preview = 0;
+    } else if (strcmp(argv[i], "--detectors") == 0 && i + 1 < argc) {
+      options.detectors = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--track") == 0 && i + 1 < argc) {
+      options.trackInterval = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--roi") == 0 && i + 1 < argc) {
+      options.roiInterval = atoi(argv[++i]);
+    } else {
+      explode("usage: core [--headless] [--detectors n] [--track n] [--roi n]\n");
+    }
+  }
 
-  Launcher_t launcher = launcherStart();
+  // one libusb context, and one event thread, for the camera and the launcher
+  Launcher_t launcher = launcherStart(captureUSBContext());
 
   Core core;
   coreInit(&core);
@@ -603,23 +647,43 @@ int main() {
   Controller_t controller = controllerInit(&core);
   controllerStart(controller);
 
-  Capture_t cap = captureInit();
-  CaptureResults results;
+  // one capture pipeline per camera, all feeding send(); the driver serves them from a single transfer thread
+  char cameraIds[CAPTURE_MAX_CAMERAS][CAPTURE_ID_LENGTH];
+  int numCameras = captureList(cameraIds, CAPTURE_MAX_CAMERAS);
+  if (numCameras == 0) {
+    explode("no cameras found\n");
+  }
+
+  if (options.detectors <= 0) {
+    // one core for the USB, grab and dispatch threads
+    options.detectors = (sysconf(_SC_NPROCESSORS_ONLN) - 1) / numCameras;
+    if (options.detectors < 1) {
+      options.detectors = 1;
+    }
+  }
+  if (options.detectors * numCameras > 1) {
+    captureDisableDetectThreads();
+  }
+
+  FaceCapture_t faceCaptures[CAPTURE_MAX_CAMERAS];
+  for (int i=0; i<numCameras; i++) {
+    printf("camera %i: %s, %d detector(s)\n", i, cameraIds[i], options.detectors);
+    faceCaptures[i] = faceCaptureInit(&core, i, cameraIds[i], &options);
+    faceCaptureStart(faceCaptures[i]);
+  }
+
+  if (!options.preview) {
+    while (1) {
+      pause();
+    }
+  }
 
+  // the main thread only draws the previews
   while (1) {
-    capture(cap, &results);
-
-    Event e;
-    e.whenOccurred = now();
-    e.type = E_FACE;
-    e.face.numFaces = results.numFaces;
-    for (int i=0; i<results.numFaces; i++) {
-      e.face.faces[i].x = results.faces[i].x;
-      e.face.faces[i].y = results.faces[i].y;
-      e.face.faces[i].width = results.faces[i].width;
-      e.face.faces[i].height = results.faces[i].height;
+    for (int i=0; i<numCameras; i++) {
+      faceCaptureShow(faceCaptures[i]);
     }
-    send(&core, e);
+    captureWait(PREVIEW_INTERVAL);
   }
 }
 
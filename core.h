@@ -9,6 +9,7 @@
  */
 
 uint64_t now();
+uint64_t nowMicros();
 
 /*
  * control event
@@ -57,6 +58,9 @@ typedef struct CapturedFace {
 #define CAPTURE_MAX_FACES 10
 
 typedef struct {
+  uint8_t cameraId;      // index into the cameras found at startup, ordered by USB port
+  uint64_t whenCaptured; // monotonic time the frame started arriving from the camera, microseconds
+  uint32_t framePts;     // camera presentation timestamp, bridge clock ticks
   uint16_t numFaces;
   CapturedFace faces[CAPTURE_MAX_FACES];
 } FaceEvent;
@@ -1,27 +1,339 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <stdatomic.h>
 #include "face-capture.h"
+#include "mailbox.h"
 #include "errors.h"
-#include "capture.h"
 
+#define DISCONNECTED_RETRY_MICROS 100000
+#define STATS_INTERVAL_MICROS 10000000
+
+// frames a reorder slot can have outstanding besides the one it is working on: one taken from its mailbox but not
+// claimed yet, one waiting in the mailbox, and the one being published
+#define REORDER_MAX_PENDING 3
+
+typedef struct Stage {
+  _Atomic uint64_t items;
+  _Atomic uint64_t busyMicros;
+} Stage;
+
+// a frame, numbered by the grab thread; unlike the driver's sequence it keeps counting across reconnects
+typedef struct GrabbedFrame {
+  CaptureFrame_t frame;
+  uint64_t seq;
+} GrabbedFrame;
+
+typedef struct Detector {
+  struct FaceCapture *c;
+  int index;
+  CaptureDetector_t detector;
+  GrabbedFrame frames[3];
+  Mailbox frameBox;      // grab -> this detector
+} Detector;
+
+// puts the detectors' (or when tracking, the tracker's) results back in frame order for dispatch, guarded by mutex
+typedef struct Reorder {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  uint64_t inFlight[FACE_CAPTURE_MAX_DETECTORS];  // frame each detector is working on, 0 when idle
+  uint64_t pending[FACE_CAPTURE_MAX_DETECTORS][REORDER_MAX_PENDING]; // frames published to each detector and not claimed yet, 0 for none
+  uint64_t doneSeq[FACE_CAPTURE_MAX_DETECTORS];   // frame of done[i], 0 when there is nothing waiting
+  CaptureResults done[FACE_CAPTURE_MAX_DETECTORS];
+  uint64_t lastDispatched;
+  uint64_t late;         // finished after a newer frame had already been dispatched
+  uint64_t overwritten;  // replaced by the same detector's next result before they could be dispatched
+} Reorder;
+
+/*
+ * Each camera runs as a pipeline:
+ *
+ *   grab:     waits for the next frame from the driver, which has already converted it to grayscale, and hands the
+ *             frames to the detectors in turn
+ *   detect:   one thread per detector, each running its own cascade on every n-th frame and scaling the faces back
+ *             up to CAPTURE_WIDTH x CAPTURE_HEIGHT
+ *   dispatch: takes the results in frame order, turns them into events and sends them to the core, which may be
+ *             busy talking to the launcher
+ *
+ * Grab and detect are joined by latest-wins mailboxes, so a detector only ever works on the newest frame it was
+ * given and never holds up grabbing. Dispatch holds a result back while a detector is still working on an older
+ * frame, and results that finish after a newer one went out are dropped, so the core never sees time go backwards.
+ *
+ * With tracking on, every frame goes to a track thread instead, which follows the last detected faces and is what
+ * dispatch hears from. It hands a copy of every trackInterval-th frame, and of every frame while it has lost all
+ * faces, to the detectors, whose results only reseed the tracker.
+ */
 typedef struct FaceCapture {
   Core_t core;
+  uint8_t cameraId;
+  Capture_t cap;
+
+  int numDetectors;
+  Detector detectors[FACE_CAPTURE_MAX_DETECTORS];
+  Reorder reorder;
+  int numProducers;      // reorder slots in use: the detectors, or just the tracker
+
+  int trackInterval;     // 0 when not tracking
+  CaptureTracker_t tracker;
+  GrabbedFrame trackFrames[3];
+  Mailbox trackBox;      // grab -> track
+
+  Stage grab;
+  Stage track;
+  Stage detect;          // all detectors together
+  Stage dispatch;
 } FaceCapture;
 
-void* faceCaptureThread(void *arg) {
+static void stageDone(Stage *s, uint64_t started) {
+  atomic_fetch_add_explicit(&s->busyMicros, nowMicros() - started, memory_order_relaxed);
+  atomic_fetch_add_explicit(&s->items, 1, memory_order_relaxed);
+}
+
+static void addPending(Reorder *r, int i, uint64_t seq) {
+  for (int j=0; j<REORDER_MAX_PENDING; j++) {
+    if (r->pending[i][j] == 0) {
+      r->pending[i][j] = seq;
+      return;
+    }
+  }
+  // see REORDER_MAX_PENDING
+  explode("reorder slot %d has too many pending frames", i);
+}
+
+static void removePending(Reorder *r, int i, uint64_t seq) {
+  for (int j=0; j<REORDER_MAX_PENDING; j++) {
+    if (r->pending[i][j] == seq) {
+      r->pending[i][j] = 0;
+    }
+  }
+}
+
+// hands a frame to the mailbox of reorder slot i. It counts as in flight from before the slot can take it until the
+// slot claims it, or the mailbox overwrites it untaken, so dispatch never lets a newer result past it.
+static void publishFrame(Reorder *r, int i, Mailbox *box, GrabbedFrame *grabbed) {
+  pthread_mutex_lock(&r->mutex);
+  addPending(r, i, grabbed->seq);
+  pthread_mutex_unlock(&r->mutex);
+
+  bool dropped;
+  GrabbedFrame *old = mailboxPublish(box, &dropped);
+  if (dropped) {
+    pthread_mutex_lock(&r->mutex);
+    removePending(r, i, old->seq);
+    // dispatch may be waiting for it
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+  }
+}
+
+void* faceCaptureGrabThread(void *arg) {
+
+  FaceCapture *c = (FaceCapture*)arg;
+
+  uint64_t seq = 0;
+  int next = 0;
+
+  int connected = 1;
+  while (1) {
+    Mailbox *box = c->trackInterval > 0 ? &c->trackBox : &c->detectors[next].frameBox;
+    GrabbedFrame *grabbed = mailboxWriteSlot(box);
+
+    if (captureGrab(c->cap, grabbed->frame) != 0) {
+      if (connected) {
+        printf("camera %d disconnected\n", c->cameraId);
+        connected = 0;
+      }
+      usleep(DISCONNECTED_RETRY_MICROS);
+      continue;
+    }
+    if (!connected) {
+      printf("camera %d reconnected\n", c->cameraId);
+      connected = 1;
+    }
+
+    // most of the grab is waiting for the camera, so only the item count means anything here
+    atomic_fetch_add_explicit(&c->grab.items, 1, memory_order_relaxed);
+    grabbed->seq = ++seq;
+    publishFrame(&c->reorder, c->trackInterval > 0 ? 0 : next, box, grabbed);
+    next = (next + 1) % c->numDetectors;
+  }
+
+  return NULL;
+}
+
+// posts results for reorder slot i, which must have claimed the frame first
+static void finished(Reorder *r, int i, uint64_t seq, CaptureResults *results) {
+  pthread_mutex_lock(&r->mutex);
+  r->inFlight[i] = 0;
+  if (seq <= r->lastDispatched) {
+    r->late++;
+  } else {
+    if (r->doneSeq[i] != 0) {
+      r->overwritten++;
+    }
+    r->done[i] = *results;
+    r->doneSeq[i] = seq;
+  }
+  // dispatch may be waiting for this result, or for this slot to stop holding back a newer one
+  pthread_cond_signal(&r->cond);
+  pthread_mutex_unlock(&r->mutex);
+}
+
+// slot i took frame seq out of its mailbox and is working on it
+static void claim(Reorder *r, int i, uint64_t seq) {
+  pthread_mutex_lock(&r->mutex);
+  removePending(r, i, seq);
+  r->inFlight[i] = seq;
+  pthread_mutex_unlock(&r->mutex);
+}
+
+void* faceCaptureTrackThread(void *arg) {
 
   FaceCapture *c = (FaceCapture*)arg;
 
-  Capture_t cap = captureInit();
   CaptureResults results;
+  uint64_t lastDetected = 0;
+  int next = 0;
 
   while (1) {
-    capture(cap, &results);
+    GrabbedFrame *grabbed = mailboxTake(&c->trackBox);
+    claim(&c->reorder, 0, grabbed->seq);
+
+    uint64_t started = nowMicros();
+    int tracked = captureTrack(c->tracker, grabbed->frame, &results);
+
+    if (tracked == 0 || grabbed->seq - lastDetected >= (uint64_t) c->trackInterval) {
+      Mailbox *box = &c->detectors[next].frameBox;
+      GrabbedFrame *copy = mailboxWriteSlot(box);
+      captureFrameCopy(copy->frame, grabbed->frame);
+      copy->seq = grabbed->seq;
+      mailboxPublish(box, NULL);
+      next = (next + 1) % c->numDetectors;
+      lastDetected = grabbed->seq;
+    }
+    stageDone(&c->track, started);
+
+    finished(&c->reorder, 0, grabbed->seq, &results);
+  }
+
+  return NULL;
+}
+
+void* faceCaptureDetectThread(void *arg) {
+
+  Detector *d = (Detector*)arg;
+  FaceCapture *c = d->c;
+  Reorder *r = &c->reorder;
+
+  CaptureResults results;
+
+  while (1) {
+    GrabbedFrame *grabbed = mailboxTake(&d->frameBox);
+
+    if (c->trackInterval > 0) {
+      uint64_t started = nowMicros();
+      captureDetect(c->cap, d->detector, grabbed->frame, &results);
+      captureTrackerSeed(c->tracker, grabbed->frame, &results);
+      stageDone(&c->detect, started);
+      continue;
+    }
+
+    claim(r, d->index, grabbed->seq);
+
+    uint64_t started = nowMicros();
+    captureDetect(c->cap, d->detector, grabbed->frame, &results);
+    stageDone(&c->detect, started);
+
+    finished(r, d->index, grabbed->seq, &results);
+  }
+
+  return NULL;
+}
+
+// waits for the oldest finished result that no detector is still working on, or about to get, an older frame for
+static void takeInOrder(Reorder *r, int numDetectors, CaptureResults *results) {
+  pthread_mutex_lock(&r->mutex);
+  while (1) {
+    int next = -1;
+    uint64_t nextSeq = UINT64_MAX;
+    uint64_t oldestInFlight = UINT64_MAX;
+    for (int i=0; i<numDetectors; i++) {
+      if (r->doneSeq[i] != 0 && r->doneSeq[i] < nextSeq) {
+        next = i;
+        nextSeq = r->doneSeq[i];
+      }
+      if (r->inFlight[i] != 0 && r->inFlight[i] < oldestInFlight) {
+        oldestInFlight = r->inFlight[i];
+      }
+      for (int j=0; j<REORDER_MAX_PENDING; j++) {
+        if (r->pending[i][j] != 0 && r->pending[i][j] < oldestInFlight) {
+          oldestInFlight = r->pending[i][j];
+        }
+      }
+    }
+
+    if (next >= 0 && nextSeq < oldestInFlight) {
+      *results = r->done[next];
+      r->doneSeq[next] = 0;
+      r->lastDispatched = nextSeq;
+      break;
+    }
+    pthread_cond_wait(&r->cond, &r->mutex);
+  }
+  pthread_mutex_unlock(&r->mutex);
+}
+
+// items and busy are per stage: grab, track, detect, dispatch
+static void printStats(FaceCapture *c, uint64_t elapsed, MailboxStats *frames, uint64_t late, uint64_t overwritten,
+                       uint64_t items[4], uint64_t busy[4], CaptureDetectStats *detect) {
+  double seconds = elapsed / 1000000.0;
+  char track[64] = "";
+  if (c->trackInterval > 0) {
+    snprintf(track, sizeof(track), "track %.1f/s, %.0f%% busy | ", items[1] / seconds, 100.0 * busy[1] / elapsed);
+  }
+  printf("camera %d: grab %.1f/s | %sframes %.0f%% full, %" PRIu64 " dropped | detect %d x %.1f/s, %.0f%% busy"
+         " | reorder %" PRIu64 " late, %" PRIu64 " overwritten | dispatch %.1f/s, %.0f%% busy\n",
+         c->cameraId,
+         items[0] / seconds,
+         track,
+         100.0 * frames->fullMicros / elapsed / c->numDetectors, frames->dropped,
+         c->numDetectors, items[2] / seconds, 100.0 * busy[2] / elapsed / c->numDetectors,
+         late, overwritten,
+         items[3] / seconds, 100.0 * busy[3] / elapsed);
+  // average time of each kind of scan, to see what the ROI search saves
+  printf("camera %d: full scans %" PRIu64 " x %.0fus | roi scans %" PRIu64 " x %.0fus, %" PRIu64 " missed\n",
+         c->cameraId,
+         detect->fullScans, detect->fullScans > 0 ? (double) detect->fullMicros / detect->fullScans : 0.0,
+         detect->roiScans, detect->roiScans > 0 ? (double) detect->roiMicros / detect->roiScans : 0.0,
+         detect->roiMisses);
+}
+
+void* faceCaptureDispatchThread(void *arg) {
+
+  FaceCapture *c = (FaceCapture*)arg;
+
+  Stage *stages[4] = { &c->grab, &c->track, &c->detect, &c->dispatch };
+  uint64_t lastItems[4] = { 0 }, lastBusy[4] = { 0 };
+  MailboxStats lastFrames = { 0 };
+  CaptureDetectStats lastDetect = { 0 };
+  uint64_t lastLate = 0, lastOverwritten = 0;
+  uint64_t lastReport = nowMicros();
+
+  CaptureResults results;
+
+  while (1) {
+    takeInOrder(&c->reorder, c->numProducers, &results);
+
+    uint64_t started = nowMicros();
 
     Event e;
     e.whenOccurred = now();
     e.type = E_FACE;
+    e.face.cameraId = c->cameraId;
+    e.face.whenCaptured = results.frameArrival;
+    e.face.framePts = results.framePts;
     e.face.numFaces = results.numFaces;
     for (int i=0; i<results.numFaces; i++) {
       e.face.faces[i].x = results.faces[i].x;
@@ -30,23 +342,141 @@ void* faceCaptureThread(void *arg) {
       e.face.faces[i].height = results.faces[i].height;
     }
     send(c->core, e);
+
+    stageDone(&c->dispatch, started);
+
+    // throughput and occupancy since the last report, as rates and fractions of the interval
+    uint64_t finished = nowMicros();
+    if (finished - lastReport >= STATS_INTERVAL_MICROS) {
+      uint64_t items[4], busy[4];
+      for (int i=0; i<4; i++) {
+        uint64_t total = atomic_load_explicit(&stages[i]->items, memory_order_relaxed);
+        items[i] = total - lastItems[i];
+        lastItems[i] = total;
+        total = atomic_load_explicit(&stages[i]->busyMicros, memory_order_relaxed);
+        busy[i] = total - lastBusy[i];
+        lastBusy[i] = total;
+      }
+
+      // the detectors' mailboxes together
+      MailboxStats frames = { 0 };
+      for (int i=0; i<c->numDetectors; i++) {
+        MailboxStats box;
+        mailboxStats(&c->detectors[i].frameBox, &box);
+        frames.published += box.published;
+        frames.dropped += box.dropped;
+        frames.fullMicros += box.fullMicros;
+      }
+      MailboxStats frameDelta = { frames.published - lastFrames.published, frames.dropped - lastFrames.dropped,
+                                  frames.fullMicros - lastFrames.fullMicros };
+      lastFrames = frames;
+
+      pthread_mutex_lock(&c->reorder.mutex);
+      uint64_t late = c->reorder.late, overwritten = c->reorder.overwritten;
+      pthread_mutex_unlock(&c->reorder.mutex);
+
+      CaptureDetectStats detect;
+      captureGetDetectStats(c->cap, &detect);
+      CaptureDetectStats detectDelta = { detect.fullScans - lastDetect.fullScans, detect.fullMicros - lastDetect.fullMicros,
+                                         detect.roiScans - lastDetect.roiScans, detect.roiMicros - lastDetect.roiMicros,
+                                         detect.roiMisses - lastDetect.roiMisses };
+      lastDetect = detect;
+
+      printStats(c, finished - lastReport, &frameDelta, late - lastLate, overwritten - lastOverwritten, items, busy,
+                 &detectDelta);
+      lastLate = late;
+      lastOverwritten = overwritten;
+      lastReport = finished;
+    }
   }
 
   return NULL;
 }
 
-FaceCapture* faceCaptureInit(Core_t core) {
+FaceCapture* faceCaptureInit(Core_t core, uint8_t cameraId, const char *id, FaceCaptureOptions *options) {
   FaceCapture *c = malloc(sizeof(FaceCapture));
   if (c == NULL) {
     explode("failed to malloc");
   }
   c->core = core;
+  c->cameraId = cameraId;
+  c->cap = captureInit(id, options->preview);
+  captureSetRoiSearch(c->cap, options->roiInterval);
+
+  int detectors = options->detectors;
+  if (detectors < 1) {
+    detectors = 1;
+  }
+  if (detectors > FACE_CAPTURE_MAX_DETECTORS) {
+    detectors = FACE_CAPTURE_MAX_DETECTORS;
+  }
+  c->numDetectors = detectors;
+  c->trackInterval = options->trackInterval > 0 ? options->trackInterval : 0;
+  c->numProducers = c->trackInterval > 0 ? 1 : c->numDetectors;
+
+  c->tracker = NULL;
+  if (c->trackInterval > 0) {
+    c->tracker = captureTrackerInit(c->cap);
+    void *frames[3];
+    for (int j=0; j<3; j++) {
+      c->trackFrames[j].frame = captureFrameAlloc(c->cap);
+      c->trackFrames[j].seq = 0;
+      frames[j] = &c->trackFrames[j];
+    }
+    mailboxInit(&c->trackBox, frames);
+  }
+
+  for (int i=0; i<c->numDetectors; i++) {
+    Detector *d = &c->detectors[i];
+    d->c = c;
+    d->index = i;
+    d->detector = captureDetectorInit(c->cap);
+
+    void *frames[3];
+    for (int j=0; j<3; j++) {
+      d->frames[j].frame = captureFrameAlloc(c->cap);
+      d->frames[j].seq = 0;
+      frames[j] = &d->frames[j];
+    }
+    mailboxInit(&d->frameBox, frames);
+  }
+
+  Reorder *r = &c->reorder;
+  pthread_mutex_init(&r->mutex, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  for (int i=0; i<FACE_CAPTURE_MAX_DETECTORS; i++) {
+    r->inFlight[i] = 0;
+    for (int j=0; j<REORDER_MAX_PENDING; j++) {
+      r->pending[i][j] = 0;
+    }
+    r->doneSeq[i] = 0;
+  }
+  r->lastDispatched = 0;
+  r->late = 0;
+  r->overwritten = 0;
+
+  Stage *stages[4] = { &c->grab, &c->track, &c->detect, &c->dispatch };
+  for (int i=0; i<4; i++) {
+    atomic_init(&stages[i]->items, 0);
+    atomic_init(&stages[i]->busyMicros, 0);
+  }
   return c;
 }
 
 void faceCaptureStart(FaceCapture *c) {
   pthread_t threadId;
-  pthread_create(&threadId, NULL, faceCaptureThread, c);
+  pthread_create(&threadId, NULL, faceCaptureDispatchThread, c);
+  for (int i=0; i<c->numDetectors; i++) {
+    pthread_create(&threadId, NULL, faceCaptureDetectThread, &c->detectors[i]);
+  }
+  if (c->trackInterval > 0) {
+    pthread_create(&threadId, NULL, faceCaptureTrackThread, c);
+  }
+  pthread_create(&threadId, NULL, faceCaptureGrabThread, c);
+}
+
+void faceCaptureShow(FaceCapture *c) {
+  captureShow(c->cap);
 }
 
 void faceCaptureStop(FaceCapture *c) {
@@ -2,11 +2,23 @@
 #define THUNDER_FACE_CAPTURE_H
 
 #include "core.h"
+#include "capture.h"
 
 typedef struct FaceCapture* FaceCapture_t;
 
-FaceCapture_t faceCaptureInit(Core_t core);
+#define FACE_CAPTURE_MAX_DETECTORS 8
+
+typedef struct FaceCaptureOptions {
+  int preview;        // 0 runs headless (see captureInit)
+  int detectors;      // threads running detection on consecutive frames at once, events still go out in frame order
+  int trackInterval;  // > 0 tracks faces on every frame, detecting only every trackInterval-th frame or on loss
+  int roiInterval;    // > 0 detects around the last face, scanning the full frame every roiInterval detections
+} FaceCaptureOptions;
+
+// captures from the camera with the given id on its own threads, sending face events tagged with cameraId
+FaceCapture_t faceCaptureInit(Core_t core, uint8_t cameraId, const char *id, FaceCaptureOptions *options);
 void faceCaptureStart(FaceCapture_t c);
+void faceCaptureShow(FaceCapture_t c); // main thread only
 void faceCaptureStop(FaceCapture_t c);
 
 #endif //THUNDER_FACE_H
@@ -18,16 +18,18 @@ int isThunder(struct libusb_device *dev) {
 
 typedef struct Launcher {
   struct libusb_context *ctx;
+  bool ownsCtx;
   libusb_device_handle *handle;
 } Launcher;
 
-Launcher_t launcherStart() {
+Launcher_t launcherStart(struct libusb_context *ctx) {
 
   Launcher *l = malloc(sizeof(Launcher));
   if (l == NULL) {
     explode("malloc failed");
   }
-  l->ctx = NULL;
+  l->ctx = ctx;
+  l->ownsCtx = ctx == NULL;
   l->handle = NULL;
 
   printf("has hotplug: %i\n", libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG));
@@ -37,9 +39,11 @@ Launcher_t launcherStart() {
   struct libusb_device **devs; //pointer to pointer of device, used to retrieve a list of devices
   int r; //for return values
   ssize_t cnt; //holding number of devices in list
-  r = libusb_init(&l->ctx); //initialize a library session
-  if(r < 0) {
-    explode("init error");
+  if (l->ownsCtx) {
+    r = libusb_init(&l->ctx); //initialize a library session
+    if(r < 0) {
+      explode("init error");
+    }
   }
 
 //  libusb_set_option(l->ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_DEBUG);
@@ -86,9 +90,9 @@ Launcher_t launcherStart() {
         printf("attempted kernel detatch: %i\n", detach);
       }
 
-      int claim = libusb_claim_interface(l->handle, ifaceNum);
+      r = libusb_claim_interface(l->handle, ifaceNum);
       if (r != LIBUSB_SUCCESS) {
-        printf("claim failed: %i\n", claim);
+        printf("claim failed: %i\n", r);
         return 0;
       }
 
@@ -105,7 +109,9 @@ Launcher_t launcherStart() {
 }
 
 void launcherStop(Launcher *l) {
-  libusb_exit(l->ctx); //close the session
+  if (l->ownsCtx) {
+    libusb_exit(l->ctx); //close the session
+  }
 }
 
 uint8_t commands[][8] = {
@@ -17,7 +17,10 @@ typedef enum {
   LAUNCHER_LEDOFF,
 } LauncherCmd;
 
-Launcher_t launcherStart();
+struct libusb_context;
+
+// ctx is the libusb context to open the launcher on, or NULL for a private one
+Launcher_t launcherStart(struct libusb_context *ctx);
 void launcherStop(Launcher_t c);
 bool launcherSend(Launcher_t launcher, LauncherCmd c);
 
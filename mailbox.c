@@ -0,0 +1,73 @@
+#include "mailbox.h"
+#include "core.h"
+
+#define MAILBOX_FRESH 0x4
+#define MAILBOX_SLOT 0x3
+
+void mailboxInit(Mailbox *m, void *slots[3]) {
+  for (int i=0; i<3; i++) {
+    m->slots[i] = slots[i];
+    m->publishedAt[i] = 0;
+  }
+  m->writing = 0;
+  atomic_init(&m->middle, 1);
+  m->reading = 2;
+
+  pthread_mutex_init(&m->mutex, NULL);
+  pthread_cond_init(&m->cond, NULL);
+
+  atomic_init(&m->published, 0);
+  atomic_init(&m->dropped, 0);
+  atomic_init(&m->fullMicros, 0);
+}
+
+void* mailboxWriteSlot(Mailbox *m) {
+  return m->slots[m->writing];
+}
+
+void* mailboxPublish(Mailbox *m, bool *dropped) {
+  uint64_t published = nowMicros();
+  m->publishedAt[m->writing] = published;
+
+  uint32_t old = atomic_exchange(&m->middle, m->writing | MAILBOX_FRESH);
+  m->writing = old & MAILBOX_SLOT;
+  atomic_fetch_add_explicit(&m->published, 1, memory_order_relaxed);
+
+  if (old & MAILBOX_FRESH) {
+    // the consumer never saw it; it was waiting until now
+    atomic_fetch_add_explicit(&m->dropped, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->fullMicros, published - m->publishedAt[m->writing], memory_order_relaxed);
+  }
+  if (dropped != NULL) {
+    *dropped = (old & MAILBOX_FRESH) != 0;
+  }
+
+  // taking the mutex orders this against a consumer that just found the mailbox empty and is about to wait
+  pthread_mutex_lock(&m->mutex);
+  pthread_cond_signal(&m->cond);
+  pthread_mutex_unlock(&m->mutex);
+
+  return m->slots[m->writing];
+}
+
+void* mailboxTake(Mailbox *m) {
+  if (!(atomic_load(&m->middle) & MAILBOX_FRESH)) {
+    pthread_mutex_lock(&m->mutex);
+    while (!(atomic_load(&m->middle) & MAILBOX_FRESH)) {
+      pthread_cond_wait(&m->cond, &m->mutex);
+    }
+    pthread_mutex_unlock(&m->mutex);
+  }
+
+  uint32_t old = atomic_exchange(&m->middle, m->reading);
+  m->reading = old & MAILBOX_SLOT;
+  atomic_fetch_add_explicit(&m->fullMicros, nowMicros() - m->publishedAt[m->reading], memory_order_relaxed);
+
+  return m->slots[m->reading];
+}
+
+void mailboxStats(Mailbox *m, MailboxStats *stats) {
+  stats->published = atomic_load_explicit(&m->published, memory_order_relaxed);
+  stats->dropped = atomic_load_explicit(&m->dropped, memory_order_relaxed);
+  stats->fullMicros = atomic_load_explicit(&m->fullMicros, memory_order_relaxed);
+}
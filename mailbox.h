@@ -0,0 +1,54 @@
+#ifndef THUNDER_MAILBOX_H
+#define THUNDER_MAILBOX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+ * Latest-wins handoff between one producer thread and one consumer thread, for pipeline stages where only the
+ * newest item matters (frames, detection results).
+ *
+ * Three slots: the producer always owns one to fill, the consumer one to read, and the third holds the newest
+ * published item. Publishing and taking swap a slot index with one atomic exchange, so neither side ever waits on
+ * the other. Publishing over an item the consumer hasn't taken yet drops the older one; a queue of depth one.
+ * The mutex and condition are only used to put an idle consumer to sleep.
+ */
+
+typedef struct Mailbox {
+  void *slots[3];
+  _Atomic uint32_t middle;     // slot index, | MAILBOX_FRESH while it holds an untaken item
+  uint32_t writing;            // producer only
+  uint32_t reading;            // consumer only
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  _Atomic uint64_t published;
+  _Atomic uint64_t dropped;    // published items overwritten before they were taken
+  _Atomic uint64_t fullMicros; // total time an untaken item was waiting, for occupancy
+  uint64_t publishedAt[3];     // per slot, written by whichever side owns it
+} Mailbox;
+
+// slots are the three items the mailbox rotates, allocated by the caller
+void mailboxInit(Mailbox *m, void *slots[3]);
+
+// the slot the producer fills next
+void* mailboxWriteSlot(Mailbox *m);
+// hands the write slot to the consumer and returns the next one to fill; if dropped isn't NULL, it tells whether that
+// is an item the consumer never took, overwritten by this one
+void* mailboxPublish(Mailbox *m, bool *dropped);
+
+// blocks until there is an item newer than the last one taken, and returns it; it stays valid until the next take
+void* mailboxTake(Mailbox *m);
+
+typedef struct MailboxStats {
+  uint64_t published;
+  uint64_t dropped;
+  uint64_t fullMicros;
+} MailboxStats;
+
+void mailboxStats(Mailbox *m, MailboxStats *stats);
+
+#endif //THUNDER_MAILBOX_H
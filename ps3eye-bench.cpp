@@ -0,0 +1,535 @@
+// Sweeps USB transfer count / size combinations on the first PS3 Eye and reports what each one achieves, to pick
+// values for PS3EYECam::init on a particular host. Each combination runs with the transfers in device memory and in
+// ordinary host memory (see PS3EYECam::setUseDeviceMemory). With --debayer it instead measures the debayer kernels on a
+// synthetic frame (no camera needed): the throughput of every kernel the CPU supports for each output format, then
+// DebayerRGB for 1 .. N band threads, to pick a value for DebayerSetThreads. --verify checks every kernel, single
+// threaded and banded, against the scalar reference on a range of odd and small frame sizes. --queue times how long
+// a completed frame takes to reach a consumer waiting for it, through the frame queue and through the mutex and
+// condition variable queue it replaced. --setup times init, start, reconfigure and stop on the first PS3 Eye, which is
+// mostly register writes; build with -DPS3EYE_NO_PIPELINED_CONTROL to compare against writing them one at a time.
+//
+// usage: ps3eye-bench [width height fps seconds]
+//        ps3eye-bench --debayer [width height frames]
+//        ps3eye-bench --verify
+//        ps3eye-bench --queue [frames interval_us]
+//        ps3eye-bench --setup [repeats]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ps3eye.h"
+#include "ps3eye-debayer.h"
+#include "ps3eye-queue.h"
+
+static const uint32_t transferCounts[] = { 2, 3, 5, 8, 16 };
+static const uint32_t transferSizes[] = { 16384, 32768, 65536, 131072, 262144 };
+
+#define WARMUP_MILLIS 500
+
+static uint64_t cpuMicros() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+typedef void (*DebayerFn)(ps3eye::EDebayerKernel kernel, int width, int height, const uint8_t *bayer, uint8_t *out);
+
+// Every output format of PS3EYECam::getFrame that goes through a debayer kernel, with the size of its output
+struct DebayerFormat {
+  const char *name;
+  DebayerFn convert;
+  int (*outputSize)(int width, int height);
+};
+
+static const DebayerFormat debayerFormats[] = {
+  { "rgb", [](ps3eye::EDebayerKernel k, int w, int h, const uint8_t *in, uint8_t *out) { ps3eye::DebayerRGB(k, w, h, in, out, false); },
+    [](int w, int h) { return w * h * 3; } },
+  { "bgr", [](ps3eye::EDebayerKernel k, int w, int h, const uint8_t *in, uint8_t *out) { ps3eye::DebayerRGB(k, w, h, in, out, true); },
+    [](int w, int h) { return w * h * 3; } },
+  { "gray", [](ps3eye::EDebayerKernel k, int w, int h, const uint8_t *in, uint8_t *out) { ps3eye::DebayerGray(k, w, h, in, out); },
+    [](int w, int h) { return w * h; } },
+  { "planar", [](ps3eye::EDebayerKernel k, int w, int h, const uint8_t *in, uint8_t *out) { ps3eye::DebayerPlanarRGB(k, w, h, in, out); },
+    [](int w, int h) { return w * h * 3; } },
+  { "i420", [](ps3eye::EDebayerKernel k, int w, int h, const uint8_t *in, uint8_t *out) { ps3eye::DebayerYUV420(k, w, h, in, out, false); },
+    [](int w, int h) { return w * h * 3 / 2; } },
+  { "nv12", [](ps3eye::EDebayerKernel k, int w, int h, const uint8_t *in, uint8_t *out) { ps3eye::DebayerYUV420(k, w, h, in, out, true); },
+    [](int w, int h) { return w * h * 3 / 2; } },
+  { "halfgray", [](ps3eye::EDebayerKernel k, int w, int h, const uint8_t *in, uint8_t *out) { ps3eye::DebayerHalfGray(k, w, h, in, out); },
+    [](int w, int h) { return (w / 2) * (h / 2); } },
+  { "halfrgb", [](ps3eye::EDebayerKernel k, int w, int h, const uint8_t *in, uint8_t *out) { ps3eye::DebayerHalfRGB(k, w, h, in, out, false); },
+    [](int w, int h) { return (w / 2) * (h / 2) * 3; } },
+  { "halfbgr", [](ps3eye::EDebayerKernel k, int w, int h, const uint8_t *in, uint8_t *out) { ps3eye::DebayerHalfRGB(k, w, h, in, out, true); },
+    [](int w, int h) { return (w / 2) * (h / 2) * 3; } },
+  { "halfplanar", [](ps3eye::EDebayerKernel k, int w, int h, const uint8_t *in, uint8_t *out) { ps3eye::DebayerHalfPlanarRGB(k, w, h, in, out); },
+    [](int w, int h) { return (w / 2) * (h / 2) * 3; } },
+  { "halfi420", [](ps3eye::EDebayerKernel k, int w, int h, const uint8_t *in, uint8_t *out) { ps3eye::DebayerHalfYUV420(k, w, h, in, out, false); },
+    [](int w, int h) { return (w / 2) * (h / 2) * 3 / 2; } },
+  { "halfnv12", [](ps3eye::EDebayerKernel k, int w, int h, const uint8_t *in, uint8_t *out) { ps3eye::DebayerHalfYUV420(k, w, h, in, out, true); },
+    [](int w, int h) { return (w / 2) * (h / 2) * 3 / 2; } },
+};
+
+static const ps3eye::EDebayerKernel debayerKernels[] = {
+  ps3eye::EDebayerKernel::Scalar, ps3eye::EDebayerKernel::SSSE3, ps3eye::EDebayerKernel::AVX2, ps3eye::EDebayerKernel::NEON
+};
+
+#define ARRAY_LENGTH(a) (sizeof(a) / sizeof((a)[0]))
+
+static std::vector<ps3eye::EDebayerKernel> supportedKernels() {
+  std::vector<ps3eye::EDebayerKernel> kernels;
+  for (ps3eye::EDebayerKernel kernel : debayerKernels) {
+    if (ps3eye::DebayerKernelSupported(kernel)) {
+      kernels.push_back(kernel);
+    }
+  }
+  return kernels;
+}
+
+static int benchDebayer(int argc, char **argv) {
+  int width = 640, height = 480, frames = 1000;
+  if (argc == 5) {
+    width = atoi(argv[2]);
+    height = atoi(argv[3]);
+    frames = atoi(argv[4]);
+  } else if (argc != 2) {
+    printf("usage: %s --debayer [width height frames]\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<uint8_t> bayer(width * height);
+  std::vector<uint8_t> rgb(width * height * 3);
+  srand(1);
+  for (uint8_t &b : bayer) {
+    b = rand();
+  }
+
+  // Megabytes of Bayer input per second, single threaded
+  std::vector<ps3eye::EDebayerKernel> kernels = supportedKernels();
+  ps3eye::DebayerSetThreads(1);
+
+  printf("%dx%d, MB/s of Bayer input on one thread\n", width, height);
+  printf("%-12s", "format");
+  for (ps3eye::EDebayerKernel kernel : kernels) {
+    printf(" %10s", ps3eye::DebayerKernelName(kernel));
+  }
+  printf("\n");
+
+  for (const DebayerFormat &format : debayerFormats) {
+    printf("%-12s", format.name);
+    for (ps3eye::EDebayerKernel kernel : kernels) {
+      for (int i = 0; i < frames / 10 + 1; ++i) {
+        format.convert(kernel, width, height, bayer.data(), rgb.data());
+      }
+
+      auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < frames; ++i) {
+        format.convert(kernel, width, height, bayer.data(), rgb.data());
+      }
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      printf(" %10.1f", (double) width * height * frames / seconds / 1000000);
+      fflush(stdout);
+    }
+    printf("\n");
+  }
+  printf("\n");
+
+  int maxThreads = std::thread::hardware_concurrency();
+  if (maxThreads < 1) {
+    maxThreads = 1;
+  }
+
+  printf("%dx%d, %s kernel\n", width, height, ps3eye::DebayerKernelName(ps3eye::DebayerGetKernel()));
+  printf("%8s %12s %10s %8s\n", "threads", "us/frame", "fps", "speedup");
+
+  double single = 0;
+  for (int threads = 1; threads <= maxThreads; ++threads) {
+    ps3eye::DebayerSetThreads(threads);
+    for (int i = 0; i < frames / 10 + 1; ++i) {
+      ps3eye::DebayerRGB(width, height, bayer.data(), rgb.data(), true);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; ++i) {
+      ps3eye::DebayerRGB(width, height, bayer.data(), rgb.data(), true);
+    }
+    double micros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / frames;
+    if (threads == 1) {
+      single = micros;
+    }
+
+    printf("%8d %12.1f %10.1f %8.2f\n", ps3eye::DebayerGetThreads(), micros, 1000000.0 / micros, single / micros);
+    fflush(stdout);
+  }
+
+  ps3eye::DebayerSetThreads(1);
+  return 0;
+}
+
+// Widths around the 16 and 32 pixel vectors and their overlapping last vector, heights around the two row phases,
+// and a few full size frames that split into bands, some of them odd
+static const int verifyWidths[] = { 3, 4, 5, 6, 7, 8, 9, 15, 16, 17, 18, 19, 31, 32, 33, 34, 35, 36, 63, 64, 65, 66, 67, 97, 130 };
+static const int verifyHeights[] = { 3, 4, 5, 6, 7, 8 };
+static const int verifyFrames[][2] = { { 320, 240 }, { 331, 241 }, { 640, 480 }, { 641, 481 }, { 646, 479 } };
+static const int verifyThreads[] = { 1, 2, 5 };
+
+#define VERIFY_GUARD_BYTES 64
+#define VERIFY_MAX_REPORTS 20
+
+struct VerifyCounts {
+  int checks = 0;
+  int failures = 0;
+};
+
+// Converts the frame with the scalar reference on one thread and with kernel on threads threads, and compares the
+// two. Both outputs start out filled with poison, so bytes that only one of them writes show up too, and are
+// followed by guard bytes that must survive.
+static void verifyFrame(const DebayerFormat &format, ps3eye::EDebayerKernel kernel, int threads, int width, int height,
+                        const std::vector<uint8_t> &bayer, VerifyCounts &counts) {
+  int size = format.outputSize(width, height);
+  std::vector<uint8_t> expected(size + VERIFY_GUARD_BYTES);
+  std::vector<uint8_t> actual(size + VERIFY_GUARD_BYTES);
+
+  for (int poison : { 0x00, 0xff }) {
+    memset(expected.data(), poison, expected.size());
+    memset(actual.data(), poison, actual.size());
+
+    ps3eye::DebayerSetThreads(1);
+    format.convert(ps3eye::EDebayerKernel::Scalar, width, height, bayer.data(), expected.data());
+    ps3eye::DebayerSetThreads(threads);
+    format.convert(kernel, width, height, bayer.data(), actual.data());
+
+    counts.checks++;
+    int mismatch = -1;
+    for (int i = 0; i < (int) actual.size() && mismatch < 0; ++i) {
+      if (actual[i] != expected[i] || (i >= size && actual[i] != poison)) {
+        mismatch = i;
+      }
+    }
+    if (mismatch < 0) {
+      continue;
+    }
+
+    if (counts.failures++ < VERIFY_MAX_REPORTS) {
+      printf("FAIL %s %s, %d thread(s), %dx%d: byte %d of %d is %d, expected %d\n", format.name,
+             ps3eye::DebayerKernelName(kernel), threads, width, height, mismatch, size, actual[mismatch], expected[mismatch]);
+    }
+    return;
+  }
+}
+
+static void verifySize(ps3eye::EDebayerKernel kernel, int threads, int width, int height, VerifyCounts &counts) {
+  // Random values, and random extremes for the clamping and rounding at either end
+  std::vector<uint8_t> bayer(width * height);
+  for (int extremes = 0; extremes < 2; ++extremes) {
+    for (uint8_t &b : bayer) {
+      b = extremes ? (rand() & 1) * 255 : rand();
+    }
+    for (const DebayerFormat &format : debayerFormats) {
+      verifyFrame(format, kernel, threads, width, height, bayer, counts);
+    }
+  }
+}
+
+static int verifyDebayer() {
+  VerifyCounts counts;
+  srand(1);
+
+  for (ps3eye::EDebayerKernel kernel : supportedKernels()) {
+    for (int threads : verifyThreads) {
+      // Scalar on one thread is the reference itself; on more it goes through the banded row drivers
+      if (kernel == ps3eye::EDebayerKernel::Scalar && threads == 1) {
+        continue;
+      }
+
+      int failuresBefore = counts.failures;
+      for (int height : verifyHeights) {
+        for (int width : verifyWidths) {
+          verifySize(kernel, threads, width, height, counts);
+        }
+      }
+      for (int i = 0; i < (int) ARRAY_LENGTH(verifyFrames); ++i) {
+        verifySize(kernel, threads, verifyFrames[i][0], verifyFrames[i][1], counts);
+      }
+
+      printf("%-8s %d thread(s): %s\n", ps3eye::DebayerKernelName(kernel), threads,
+             counts.failures == failuresBefore ? "ok" : "FAILED");
+      fflush(stdout);
+    }
+  }
+
+  ps3eye::DebayerSetThreads(1);
+  printf("%d checks, %d failed\n", counts.checks, counts.failures);
+  return counts.failures == 0 ? 0 : 1;
+}
+
+static uint64_t nowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The frame queue as it was before the lock-free rings: two buffers, and a mutex and condition variable around the
+// head, tail and count. Only the handoff is kept; the stamps stand in for the frames.
+class MutexFrameQueue {
+public:
+  // Producer. Like the original, publishes nothing while the consumer hasn't taken the previous frame yet
+  void enqueue(uint64_t sent) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (available >= 1) {
+      return;
+    }
+    stamps[head] = sent;
+    head = (head + 1) % 2;
+    available++;
+    condition.notify_one();
+  }
+
+  // Consumer. False once finish has been called and everything queued was taken
+  bool dequeue(uint64_t &sent) {
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [this] () { return available != 0 || finished; });
+    if (available == 0) {
+      return false;
+    }
+    sent = stamps[tail];
+    tail = (tail + 1) % 2;
+    available--;
+    return true;
+  }
+
+  void finish() {
+    std::lock_guard<std::mutex> lock(mutex);
+    finished = true;
+    condition.notify_one();
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable condition;
+  uint64_t stamps[2] = { 0, 0 };
+  int head = 0;
+  int tail = 0;
+  int available = 0;
+  bool finished = false;
+};
+
+// Publishes frames frames, interval microseconds apart so the consumer is usually waiting, each stamped with the
+// time it was published
+template<typename Publish>
+static std::thread startProducer(int frames, int interval, Publish publish) {
+  return std::thread([=] () {
+    for (int i = 0; i < frames; ++i) {
+      std::this_thread::sleep_for(std::chrono::microseconds(interval));
+      publish(nowNanos());
+    }
+  });
+}
+
+static void printLatencies(const char *name, std::vector<uint64_t> &latencies) {
+  if (latencies.empty()) {
+    printf("%-10s no frames\n", name);
+    return;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  size_t count = latencies.size();
+  printf("%-10s %8zu %10.1f %10.1f %10.1f %10.1f\n", name, count, latencies[0] / 1000.0, latencies[count / 2] / 1000.0,
+         latencies[count * 99 / 100] / 1000.0, latencies[count - 1] / 1000.0);
+  fflush(stdout);
+}
+
+static int benchQueue(int argc, char **argv) {
+  int frames = 20000, interval = 200;
+  if (argc == 4) {
+    frames = atoi(argv[2]);
+    interval = atoi(argv[3]);
+  } else if (argc != 2) {
+    printf("usage: %s --queue [frames interval_us]\n", argv[0]);
+    return 1;
+  }
+
+  printf("%d frames, %dus apart, latency from publish to the waiting consumer in us\n", frames, interval);
+  printf("%-10s %8s %10s %10s %10s %10s\n", "queue", "frames", "min", "median", "p99", "max");
+
+  std::vector<uint64_t> latencies;
+  latencies.reserve(frames);
+
+  {
+    MutexFrameQueue queue;
+    std::thread producer = startProducer(frames, interval, [&queue] (uint64_t sent) { queue.enqueue(sent); });
+    std::thread finisher([&] () { producer.join(); queue.finish(); });
+
+    uint64_t sent;
+    while (queue.dequeue(sent)) {
+      latencies.push_back(nowNanos() - sent);
+    }
+    finisher.join();
+    printLatencies("mutex", latencies);
+  }
+
+  latencies.clear();
+
+  {
+    // The driver's queue with the defaults of PS3EYECam::init. Frames are never written, so one byte each will do;
+    // arrival carries the stamp in nanoseconds instead of microseconds.
+    ps3eye::FrameQueue queue(1, 2, ps3eye::PS3EYECam::EDropPolicy::DropNewest);
+    std::thread producer = startProducer(frames, interval, [&queue] (uint64_t sent) {
+      ps3eye::PS3EYECam::FrameInfo info;
+      info.arrival = sent;
+      queue.Enqueue(info);
+    });
+    std::thread finisher([&] () { producer.join(); queue.Disconnect(); });
+
+    for (;;) {
+      uint32_t frame = queue.Claim();
+      if (frame == ps3eye::FrameQueue::NO_FRAME) {
+        break;
+      }
+      latencies.push_back(nowNanos() - queue.GetFrameInfo(frame).arrival);
+      queue.Release(frame);
+    }
+    finisher.join();
+    printLatencies("lock-free", latencies);
+  }
+
+  return 0;
+}
+
+static double millisSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static int benchSetup(int argc, char **argv) {
+  int repeats = 5;
+  if (argc == 3) {
+    repeats = atoi(argv[2]);
+  } else if (argc != 2) {
+    printf("usage: %s --setup [repeats]\n", argv[0]);
+    return 1;
+  }
+
+  const auto eyeDevices = ps3eye::PS3EYECam::getDevices();
+  if (eyeDevices.empty()) {
+    printf("no PS3 Eye found\n");
+    return 1;
+  }
+  ps3eye::PS3EYECam *device = eyeDevices.front().get();
+
+  printf("%8s %10s %10s %12s %12s %10s\n", "run", "init ms", "start ms", "to QVGA ms", "to VGA ms", "stop ms");
+  for (int run = 0; run < repeats; run++) {
+    auto start = std::chrono::steady_clock::now();
+    if (!device->init(640, 480, 60, ps3eye::PS3EYECam::EOutputFormat::Bayer)) {
+      printf("init failed\n");
+      return 1;
+    }
+    double initMillis = millisSince(start);
+
+    start = std::chrono::steady_clock::now();
+    device->start();
+    double startMillis = millisSince(start);
+
+    start = std::chrono::steady_clock::now();
+    device->reconfigure(320, 240, 60);
+    double qvgaMillis = millisSince(start);
+
+    start = std::chrono::steady_clock::now();
+    device->reconfigure(640, 480, 60);
+    double vgaMillis = millisSince(start);
+
+    start = std::chrono::steady_clock::now();
+    device->stop();
+    double stopMillis = millisSince(start);
+
+    printf("%8d %10.1f %10.1f %12.1f %12.1f %10.1f\n", run, initMillis, startMillis, qvgaMillis, vgaMillis, stopMillis);
+    fflush(stdout);
+  }
+
+  return 0;
+}
+
+int main(int argc, char **argv) {
+
+  if (argc >= 2 && strcmp(argv[1], "--debayer") == 0) {
+    return benchDebayer(argc, argv);
+  }
+  if (argc == 2 && strcmp(argv[1], "--verify") == 0) {
+    return verifyDebayer();
+  }
+  if (argc >= 2 && strcmp(argv[1], "--queue") == 0) {
+    return benchQueue(argc, argv);
+  }
+  if (argc >= 2 && strcmp(argv[1], "--setup") == 0) {
+    return benchSetup(argc, argv);
+  }
+
+  uint32_t width = 320, height = 240, fps = 187, seconds = 5;
+  if (argc == 5) {
+    width = atoi(argv[1]);
+    height = atoi(argv[2]);
+    fps = atoi(argv[3]);
+    seconds = atoi(argv[4]);
+  } else if (argc != 1) {
+    printf("usage: %s [width height fps seconds]\n", argv[0]);
+    return 1;
+  }
+
+  const auto eyeDevices = ps3eye::PS3EYECam::getDevices();
+  if (eyeDevices.empty()) {
+    printf("no PS3 Eye found\n");
+    return 1;
+  }
+  ps3eye::PS3EYECam *device = eyeDevices.front().get();
+
+  printf("%8s %8s %8s %8s %10s %10s %14s\n", "count", "size", "memory", "fps", "discard%", "payloadErr", "cpu us/frame");
+
+  for (uint32_t count : transferCounts) {
+    for (uint32_t size : transferSizes) {
+      for (bool deviceMemory : { true, false }) {
+
+        // Nobody reads the frames, so this measures the USB side only: the driver overwrites the newest frame for free
+        if (!device->init(width, height, fps, ps3eye::PS3EYECam::EOutputFormat::Bayer, 2,
+                          ps3eye::PS3EYECam::EDropPolicy::DropNewest, count, size)) {
+          printf("init failed\n");
+          return 1;
+        }
+        device->setUseDeviceMemory(deviceMemory);
+        device->start();
+        std::this_thread::sleep_for(std::chrono::milliseconds(WARMUP_MILLIS));
+
+        ps3eye::PS3EYECam::StreamStats before = device->getStats();
+        uint64_t cpuBefore = cpuMicros();
+        auto start = std::chrono::steady_clock::now();
+
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+
+        ps3eye::PS3EYECam::StreamStats after = device->getStats();
+        uint64_t cpu = cpuMicros() - cpuBefore;
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        device->stop();
+
+        uint64_t frames = after.frames - before.frames;
+        uint64_t discarded = (after.oversizeFrames - before.oversizeFrames)
+                           + (after.shortFrames - before.shortFrames)
+                           + (after.incompleteFrames - before.incompleteFrames);
+        uint64_t payloadErrors = (after.badHeaders - before.badHeaders)
+                               + (after.payloadErrors - before.payloadErrors)
+                               + (after.missingPts - before.missingPts);
+
+        printf("%8u %8u %8s %8.1f %10.2f %10llu %14.1f\n", device->getTransferCount(), device->getTransferSize(),
+               device->isUsingDeviceMemory() ? "device" : "host",
+               frames / elapsed,
+               frames + discarded > 0 ? 100.0 * discarded / (frames + discarded) : 0.0,
+               (unsigned long long) payloadErrors,
+               frames > 0 ? (double) cpu / frames : 0.0);
+        fflush(stdout);
+      }
+    }
+  }
+
+  return 0;
+}
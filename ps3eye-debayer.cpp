@@ -0,0 +1,1482 @@
+// Debayer kernels for the GRBG output of the PS3 Eye's OV772x sensor
+#include "ps3eye-debayer.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+	#define PS3EYE_DEBAYER_X86 1
+	#include <immintrin.h>
+	#define PS3EYE_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)
+	#define PS3EYE_DEBAYER_NEON 1
+	#include <arm_neon.h>
+#endif
+
+namespace ps3eye {
+
+// Scalar reference
+//
+// These are the original per-pixel routines from the frame queue. The SIMD kernels below are checked against them.
+
+static void DebayerGrayScalar(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer)
+{
+	// PSMove output is in the following Bayer format (GRBG):
+	//
+	// G R G R G R
+	// B G B G B G
+	// G R G R G R
+	// B G B G B G
+	//
+	// This is the normal Bayer pattern shifted left one place.
+	
+	int				source_stride	= frame_width;
+	const uint8_t*	source_row		= inBayer;						// Start at first bayer pixel
+	int				dest_stride		= frame_width;
+	uint8_t*		dest_row		= outBuffer + dest_stride + 1; 	// We start outputting at the second pixel of the second row's G component
+	uint32_t R,G,B;
+	
+	// Fill rows 1 to height-2 of the destination buffer. First and last row are filled separately (they are copied from the second row and second-to-last rows respectively),
+	// so the last row is never computed, which would read a row past the end of the source
+	for (int y = 0; y < frame_height-2; source_row += source_stride, dest_row += dest_stride, ++y)
+	{
+		const uint8_t* source		= source_row;
+		const uint8_t* source_end	= source + (source_stride-2);								// -2 to deal with the fact that we're starting at the second pixel of the row and should end at the second-to-last pixel of the row (first and last are filled separately)
+		uint8_t* dest				= dest_row;
+		
+		// Row starting with Green
+		if (y % 2 == 0)
+		{
+			// Fill first pixel (green)
+			B = (source[source_stride] + source[source_stride + 2] + 1) >> 1;
+			G = source[source_stride + 1];
+			R = (source[1] + source[source_stride * 2 + 1] + 1) >> 1;
+			*dest = (uint8_t)((R*77 + G*151 + B*28)>>8);
+			
+			source++;
+			dest++;
+			
+			// Fill remaining pixel
+			for (; source <= source_end - 2; source += 2, dest += 2)
+			{
+				// Blue pixel
+				B = source[source_stride + 1];
+				G = (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;
+				R = (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;
+				dest[0] = (uint8_t)((R*77 + G*151 + B*28)>>8);
+
+				//  Green pixel
+				B = (source[source_stride + 1] + source[source_stride + 3] + 1) >> 1;
+				G = source[source_stride + 2];
+				R = (source[2] + source[source_stride * 2 + 2] + 1) >> 1;
+				dest[1] = (uint8_t)((R*77 + G*151 + B*28)>>8);
+
+			}
+		}
+		else
+		{
+			for (; source <= source_end - 2; source += 2, dest += 2)
+			{
+				// Red pixel
+				B = (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;;
+				G = (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;;
+				R = source[source_stride + 1];
+				dest[0] = (uint8_t)((R*77 + G*151 + B*28)>>8);
+
+				// Green pixel
+				B = (source[2] + source[source_stride * 2 + 2] + 1) >> 1;
+				G = source[source_stride + 2];
+				R = (source[source_stride + 1] + source[source_stride + 3] + 1) >> 1;
+				dest[1] = (uint8_t)((R*77 + G*151 + B*28)>>8);
+			}
+		}
+		
+		// One pixel left over: a blue one when the width is even, a red one when it is odd
+		if (source < source_end)
+		{
+			if (y % 2 == 0)
+			{
+				B = source[source_stride + 1];
+				R = (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;
+			}
+			else
+			{
+				B = (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;
+				R = source[source_stride + 1];
+			}
+			G = (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;
+			dest[0] = (uint8_t)((R*77 + G*151 + B*28)>>8);
+
+			source++;
+			dest++;
+		}
+		
+		// Fill first pixel of row (copy second pixel)
+		uint8_t* first_pixel	= dest_row-1;
+		first_pixel[0]			= dest_row[0];
+		
+		// Fill last pixel of row (copy second-to-last pixel). Note: dest row starts at the *second* pixel of the row, so dest_row + (width-2) * num_output_channels puts us at the last pixel of the row
+		uint8_t* last_pixel				= dest_row + (frame_width - 2);
+		uint8_t* second_to_last_pixel	= last_pixel - 1;
+		last_pixel[0]					= second_to_last_pixel[0];
+	}
+	
+	// Fill first & last row
+	for (int i = 0; i < dest_stride; i++)
+	{
+		outBuffer[i]									= outBuffer[i + dest_stride];
+		outBuffer[i + (frame_height - 1)*dest_stride]	= outBuffer[i + (frame_height - 2)*dest_stride];
+	}
+}
+
+static void DebayerRGBScalar(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool inBGR)
+{
+	// PSMove output is in the following Bayer format (GRBG):
+	//
+	// G R G R G R
+	// B G B G B G
+	// G R G R G R
+	// B G B G B G
+	//
+	// This is the normal Bayer pattern shifted left one place.
+
+	int				num_output_channels	    = 3;
+	int				source_stride			= frame_width;
+	const uint8_t*	source_row				= inBayer;												// Start at first bayer pixel
+	int				dest_stride				= frame_width * num_output_channels;
+	uint8_t*		dest_row				= outBuffer + dest_stride + num_output_channels + 1; 	// We start outputting at the second pixel of the second row's G component
+	int				swap_br					= inBGR ? 1 : -1;
+
+	// Fill rows 1 to height-2 of the destination buffer. First and last row are filled separately (they are copied from the second row and second-to-last rows respectively),
+	// so the last row is never computed, which would read a row past the end of the source
+	for (int y = 0; y < frame_height-2; source_row += source_stride, dest_row += dest_stride, ++y)
+	{
+		const uint8_t* source		= source_row;
+		const uint8_t* source_end	= source + (source_stride-2);								// -2 to deal with the fact that we're starting at the second pixel of the row and should end at the second-to-last pixel of the row (first and last are filled separately)
+		uint8_t* dest				= dest_row;		
+
+		// Row starting with Green
+		if (y % 2 == 0)
+		{
+			// Fill first pixel (green)
+			dest[-1*swap_br]	= (source[source_stride] + source[source_stride + 2] + 1) >> 1;
+			dest[0]				= source[source_stride + 1];
+			dest[1*swap_br]		= (source[1] + source[source_stride * 2 + 1] + 1) >> 1;		
+
+			source++;
+			dest += num_output_channels;
+
+			// Fill remaining pixel
+			for (; source <= source_end - 2; source += 2, dest += num_output_channels * 2)
+			{
+				// Blue pixel
+				uint8_t* cur_pixel	= dest;
+				cur_pixel[-1*swap_br]	= source[source_stride + 1];
+				cur_pixel[0]			= (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;
+				cur_pixel[1*swap_br]	= (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;				
+
+				//  Green pixel
+				uint8_t* next_pixel		= cur_pixel+num_output_channels;
+				next_pixel[-1*swap_br]	= (source[source_stride + 1] + source[source_stride + 3] + 1) >> 1;					
+				next_pixel[0]			= source[source_stride + 2];
+				next_pixel[1*swap_br]	= (source[2] + source[source_stride * 2 + 2] + 1) >> 1;
+			}
+		}
+		else
+		{
+			for (; source <= source_end - 2; source += 2, dest += num_output_channels * 2)
+			{
+				// Red pixel
+				uint8_t* cur_pixel	= dest;
+				cur_pixel[-1*swap_br]	= (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;;
+				cur_pixel[0]			= (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;;
+				cur_pixel[1*swap_br]	= source[source_stride + 1];
+
+				// Green pixel
+				uint8_t* next_pixel		= cur_pixel+num_output_channels;
+				next_pixel[-1*swap_br]	= (source[2] + source[source_stride * 2 + 2] + 1) >> 1;
+				next_pixel[0]			= source[source_stride + 2];
+				next_pixel[1*swap_br]	= (source[source_stride + 1] + source[source_stride + 3] + 1) >> 1;
+			}
+		}
+
+		// One pixel left over: a blue one when the width is even, a red one when it is odd
+		if (source < source_end)
+		{
+			uint8_t center		= source[source_stride + 1];
+			uint8_t diagonal	= (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;
+			dest[-1*swap_br]	= (y % 2 == 0) ? center : diagonal;
+			dest[0]				= (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;			
+			dest[1*swap_br]		= (y % 2 == 0) ? diagonal : center;
+
+			source++;
+			dest += num_output_channels;
+		}
+
+		// Fill first pixel of row (copy second pixel)
+		uint8_t* first_pixel		= dest_row-num_output_channels;
+		first_pixel[-1*swap_br]		= dest_row[-1*swap_br];
+		first_pixel[0]				= dest_row[0];
+		first_pixel[1*swap_br]		= dest_row[1*swap_br];
+	
+ 			// Fill last pixel of row (copy second-to-last pixel). Note: dest row starts at the *second* pixel of the row, so dest_row + (width-2) * num_output_channels puts us at the last pixel of the row
+		uint8_t* last_pixel				= dest_row + (frame_width - 2)*num_output_channels;
+		uint8_t* second_to_last_pixel	= last_pixel - num_output_channels;
+		
+		last_pixel[-1*swap_br]			= second_to_last_pixel[-1*swap_br];
+		last_pixel[0]					= second_to_last_pixel[0];
+		last_pixel[1*swap_br]			= second_to_last_pixel[1*swap_br];
+	}
+
+	// Fill first & last row
+	for (int i = 0; i < dest_stride; i++)
+	{
+		outBuffer[i]									= outBuffer[i + dest_stride];
+		outBuffer[i + (frame_height - 1)*dest_stride]	= outBuffer[i + (frame_height - 2)*dest_stride];
+	}
+}
+
+// Half resolution luma straight from each quad:
+//
+// G R
+// B G
+//
+// The two greens are averaged and weighted like in DebayerGray.
+static inline uint8_t QuadLuma(uint32_t G1, uint32_t R, uint32_t B, uint32_t G2)
+{
+	uint32_t G = (G1 + G2 + 1) >> 1;
+	return (uint8_t)((R*77 + G*151 + B*28)>>8);
+}
+
+static void DebayerHalfGrayScalar(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer)
+{
+	int out_width	= frame_width / 2;
+	int out_height	= frame_height / 2;
+
+	for (int y = 0; y < out_height; ++y)
+	{
+		const uint8_t*	gr		= inBayer + (y * 2) * frame_width;
+		const uint8_t*	bg		= gr + frame_width;
+		uint8_t*		dest	= outBuffer + y * out_width;
+
+		for (int x = 0; x < out_width; ++x)
+			dest[x] = QuadLuma(gr[x * 2], gr[x * 2 + 1], bg[x * 2], bg[x * 2 + 1]);
+	}
+}
+
+// Full range BT.601 chroma (the JPEG flavour), to go with the luma weights above. The sums are offset so they never go
+// negative; only the top end needs clamping.
+static inline uint8_t ChromaU(uint32_t R, uint32_t G, uint32_t B)
+{
+	int U = (128*(int)B - 43*(int)R - 85*(int)G + 32896) >> 8;
+	return (uint8_t)(U > 255 ? 255 : U);
+}
+
+static inline uint8_t ChromaV(uint32_t R, uint32_t G, uint32_t B)
+{
+	int V = (128*(int)R - 107*(int)G - 21*(int)B + 32896) >> 8;
+	return (uint8_t)(V > 255 ? 255 : V);
+}
+
+// 4:2:0 chroma straight from the quads: each chroma sample averages the R, G and B of quads x quads quads, i.e. one
+// quad for a full resolution image and 2x2 for a half resolution one. U and V are written step bytes apart, 1 for
+// separate planes and 2 for interleaved U V pairs.
+static void DebayerChroma420(int frame_width, int frame_height, int quads, const uint8_t* inBayer, uint8_t* outU, uint8_t* outV, int step)
+{
+	int out_width	= frame_width / (2 * quads);
+	int out_height	= frame_height / (2 * quads);
+	int count		= quads * quads;
+
+	for (int y = 0; y < out_height; ++y)
+	{
+		const uint8_t*	row		= inBayer + (y * 2 * quads) * frame_width;
+		uint8_t*		dest_u	= outU + y * out_width * step;
+		uint8_t*		dest_v	= outV + y * out_width * step;
+
+		for (int x = 0; x < out_width; ++x)
+		{
+			uint32_t R = 0, G = 0, B = 0;
+			for (int qy = 0; qy < quads; ++qy)
+			{
+				const uint8_t* gr = row + (qy * 2) * frame_width + x * 2 * quads;
+				const uint8_t* bg = gr + frame_width;
+				for (int qx = 0; qx < quads * 2; qx += 2)
+				{
+					R += gr[qx + 1];
+					G += gr[qx] + bg[qx + 1];
+					B += bg[qx];
+				}
+			}
+			R = (R + count / 2) / count;
+			G = (G + count) / (count * 2);
+			B = (B + count / 2) / count;
+
+			dest_u[x * step] = ChromaU(R, G, B);
+			dest_v[x * step] = ChromaV(R, G, B);
+		}
+	}
+}
+
+static void DebayerHalfRGBScalar(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool inBGR)
+{
+	int out_width	= frame_width / 2;
+	int out_height	= frame_height / 2;
+	int b_offset	= inBGR ? 0 : 2;
+	int r_offset	= inBGR ? 2 : 0;
+
+	for (int y = 0; y < out_height; ++y)
+	{
+		const uint8_t*	gr		= inBayer + (y * 2) * frame_width;
+		const uint8_t*	bg		= gr + frame_width;
+		uint8_t*		dest	= outBuffer + y * out_width * 3;
+
+		for (int x = 0; x < out_width; ++x, dest += 3)
+		{
+			dest[b_offset]	= bg[x * 2];
+			dest[1]			= (gr[x * 2] + bg[x * 2 + 1] + 1) >> 1;
+			dest[r_offset]	= gr[x * 2 + 1];
+		}
+	}
+}
+
+static void DebayerHalfPlanarRGBScalar(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer)
+{
+	int out_width	= frame_width / 2;
+	int out_height	= frame_height / 2;
+	int plane_size	= out_width * out_height;
+
+	for (int y = 0; y < out_height; ++y)
+	{
+		const uint8_t*	gr		= inBayer + (y * 2) * frame_width;
+		const uint8_t*	bg		= gr + frame_width;
+		uint8_t*		dest_r	= outBuffer + y * out_width;
+		uint8_t*		dest_g	= dest_r + plane_size;
+		uint8_t*		dest_b	= dest_g + plane_size;
+
+		for (int x = 0; x < out_width; ++x)
+		{
+			dest_r[x] = gr[x * 2 + 1];
+			dest_g[x] = (gr[x * 2] + bg[x * 2 + 1] + 1) >> 1;
+			dest_b[x] = bg[x * 2];
+		}
+	}
+}
+
+// Row kernels
+//
+// The SIMD kernels work one output row at a time. For output row y (1 <= y < height-1) the interior pixels
+// x = 1 .. width-2 are interpolated from the source rows y-1, y and y+1:
+//
+//   horz  = (mid[x-1] + mid[x+1] + 1) >> 1
+//   vert  = (top[x] + bot[x] + 1) >> 1
+//   cross = (top[x] + mid[x-1] + mid[x+1] + bot[x] + 2) >> 2
+//   diag  = (top[x-1] + top[x+1] + bot[x-1] + bot[x+1] + 2) >> 2
+//
+// Odd rows are B G B G ..., even rows are G R G R ... (see the reference above). Which of these values ends up in
+// R, G and B only depends on the row and the parity of x, so a kernel computes all of them for a whole vector and
+// then selects per lane. Vectors always start at an odd x, so even lanes hold odd pixels.
+//
+// A row kernel returns the first x it did not process; anything left (rows narrower than one vector) is
+// finished by DebayerPixel.
+
+// Start of the last full vector in a row, overlapping the previous one so the row is finished without a scalar
+// tail. Recomputing a pixel gives the same value, so the overlap is harmless. Vectors start at an odd x, so on odd
+// widths the vector ends one pixel short and the caller finishes that one. Returns 0 if the row is too short.
+static inline int DebayerLastVector(int frame_width, int vector_width)
+{
+	int x = frame_width - 1 - vector_width;
+	if ((x & 1) == 0)
+		--x;
+	return x >= 1 ? x : 0;
+}
+
+typedef int (*DebayerRowRGBFn)(int frame_width, const uint8_t* top, const uint8_t* mid, const uint8_t* bot, uint8_t* dest, bool bg_row, bool inBGR);
+typedef int (*DebayerRowGrayFn)(int frame_width, const uint8_t* top, const uint8_t* mid, const uint8_t* bot, uint8_t* dest, bool bg_row);
+typedef int (*DebayerRowPlanarFn)(int frame_width, const uint8_t* top, const uint8_t* mid, const uint8_t* bot, uint8_t* dest_r, uint8_t* dest_g, uint8_t* dest_b, bool bg_row);
+
+static inline void DebayerPixel(const uint8_t* top, const uint8_t* mid, const uint8_t* bot, int x, bool bg_row, uint32_t& R, uint32_t& G, uint32_t& B)
+{
+	uint32_t center	= mid[x];
+	uint32_t horz	= (mid[x - 1] + mid[x + 1] + 1) >> 1;
+	uint32_t vert	= (top[x] + bot[x] + 1) >> 1;
+	uint32_t cross	= (top[x] + mid[x - 1] + mid[x + 1] + bot[x] + 2) >> 2;
+	uint32_t diag	= (top[x - 1] + top[x + 1] + bot[x - 1] + bot[x + 1] + 2) >> 2;
+
+	if (bg_row)
+	{
+		if (x & 1)	{ B = horz;		G = center;	R = vert; }		// Green pixel
+		else		{ B = center;	G = cross;	R = diag; }		// Blue pixel
+	}
+	else
+	{
+		if (x & 1)	{ B = diag;		G = cross;	R = center; }	// Red pixel
+		else		{ B = vert;		G = center;	R = horz; }		// Green pixel
+	}
+}
+
+// Converts quads [0, out_width) of one quad row, returns the first quad it did not process
+typedef int (*DebayerRowHalfGrayFn)(int out_width, const uint8_t* gr, const uint8_t* bg, uint8_t* dest);
+
+static void DebayerRowsHalfGray(DebayerRowHalfGrayFn row_fn, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer)
+{
+	int out_width	= frame_width / 2;
+	int out_height	= frame_height / 2;
+
+	for (int y = 0; y < out_height; ++y)
+	{
+		const uint8_t*	gr		= inBayer + (y * 2) * frame_width;
+		const uint8_t*	bg		= gr + frame_width;
+		uint8_t*		dest	= outBuffer + y * out_width;
+
+		int x = row_fn(out_width, gr, bg, dest);
+		for (; x < out_width; ++x)
+			dest[x] = QuadLuma(gr[x * 2], gr[x * 2 + 1], bg[x * 2], bg[x * 2 + 1]);
+	}
+}
+
+// The row drivers fill output rows [y_begin, y_end), which lets a frame be split into bands (see DebayerBands).
+// A band holds at least two rows, so the band with the first or last row also computes the neighbour it copies.
+static void DebayerRowsRGB(DebayerRowRGBFn row_fn, int frame_width, int frame_height, int y_begin, int y_end, const uint8_t* inBayer, uint8_t* outBuffer, bool inBGR)
+{
+	int	dest_stride	= frame_width * 3;
+	int	b_offset	= inBGR ? 0 : 2;
+	int	r_offset	= inBGR ? 2 : 0;
+
+	for (int y = y_begin > 1 ? y_begin : 1; y < y_end && y < frame_height - 1; ++y)
+	{
+		const uint8_t*	mid		= inBayer + y * frame_width;
+		const uint8_t*	top		= mid - frame_width;
+		const uint8_t*	bot		= mid + frame_width;
+		uint8_t*		dest	= outBuffer + y * dest_stride;
+		bool			bg_row	= (y & 1) != 0;
+
+		int x = row_fn(frame_width, top, mid, bot, dest, bg_row, inBGR);
+		for (; x < frame_width - 1; ++x)
+		{
+			uint32_t R, G, B;
+			DebayerPixel(top, mid, bot, x, bg_row, R, G, B);
+			dest[x * 3 + b_offset]	= (uint8_t)B;
+			dest[x * 3 + 1]			= (uint8_t)G;
+			dest[x * 3 + r_offset]	= (uint8_t)R;
+		}
+
+		// First and last pixel of the row are copies of their neighbours
+		memcpy(dest, dest + 3, 3);
+		memcpy(dest + dest_stride - 3, dest + dest_stride - 6, 3);
+	}
+
+	// First and last row are copies of their neighbours
+	if (y_begin == 0)
+		memcpy(outBuffer, outBuffer + dest_stride, dest_stride);
+	if (y_end == frame_height)
+		memcpy(outBuffer + (frame_height - 1) * dest_stride, outBuffer + (frame_height - 2) * dest_stride, dest_stride);
+}
+
+static void DebayerRowsGray(DebayerRowGrayFn row_fn, int frame_width, int frame_height, int y_begin, int y_end, const uint8_t* inBayer, uint8_t* outBuffer)
+{
+	int	dest_stride	= frame_width;
+
+	for (int y = y_begin > 1 ? y_begin : 1; y < y_end && y < frame_height - 1; ++y)
+	{
+		const uint8_t*	mid		= inBayer + y * frame_width;
+		const uint8_t*	top		= mid - frame_width;
+		const uint8_t*	bot		= mid + frame_width;
+		uint8_t*		dest	= outBuffer + y * dest_stride;
+		bool			bg_row	= (y & 1) != 0;
+
+		int x = row_fn(frame_width, top, mid, bot, dest, bg_row);
+		for (; x < frame_width - 1; ++x)
+		{
+			uint32_t R, G, B;
+			DebayerPixel(top, mid, bot, x, bg_row, R, G, B);
+			dest[x] = (uint8_t)((R*77 + G*151 + B*28)>>8);
+		}
+
+		dest[0]					= dest[1];
+		dest[frame_width - 1]	= dest[frame_width - 2];
+	}
+
+	if (y_begin == 0)
+		memcpy(outBuffer, outBuffer + dest_stride, dest_stride);
+	if (y_end == frame_height)
+		memcpy(outBuffer + (frame_height - 1) * dest_stride, outBuffer + (frame_height - 2) * dest_stride, dest_stride);
+}
+
+// Three planes, so each one is filled like a gray image
+static void DebayerRowsPlanarRGB(DebayerRowPlanarFn row_fn, int frame_width, int frame_height, int y_begin, int y_end, const uint8_t* inBayer, uint8_t* outBuffer)
+{
+	int			dest_stride	= frame_width;
+	int			plane_size	= frame_width * frame_height;
+	uint8_t*	planes[3]	= { outBuffer, outBuffer + plane_size, outBuffer + plane_size * 2 };
+
+	for (int y = y_begin > 1 ? y_begin : 1; y < y_end && y < frame_height - 1; ++y)
+	{
+		const uint8_t*	mid		= inBayer + y * frame_width;
+		const uint8_t*	top		= mid - frame_width;
+		const uint8_t*	bot		= mid + frame_width;
+		uint8_t*		dest_r	= planes[0] + y * dest_stride;
+		uint8_t*		dest_g	= planes[1] + y * dest_stride;
+		uint8_t*		dest_b	= planes[2] + y * dest_stride;
+		bool			bg_row	= (y & 1) != 0;
+
+		int x = row_fn(frame_width, top, mid, bot, dest_r, dest_g, dest_b, bg_row);
+		for (; x < frame_width - 1; ++x)
+		{
+			uint32_t R, G, B;
+			DebayerPixel(top, mid, bot, x, bg_row, R, G, B);
+			dest_r[x] = (uint8_t)R;
+			dest_g[x] = (uint8_t)G;
+			dest_b[x] = (uint8_t)B;
+		}
+
+		dest_r[0] = dest_r[1];	dest_r[frame_width - 1] = dest_r[frame_width - 2];
+		dest_g[0] = dest_g[1];	dest_g[frame_width - 1] = dest_g[frame_width - 2];
+		dest_b[0] = dest_b[1];	dest_b[frame_width - 1] = dest_b[frame_width - 2];
+	}
+
+	for (int plane = 0; plane < 3; ++plane)
+	{
+		uint8_t* dest = planes[plane];
+		if (y_begin == 0)
+			memcpy(dest, dest + dest_stride, dest_stride);
+		if (y_end == frame_height)
+			memcpy(dest + (frame_height - 1) * dest_stride, dest + (frame_height - 2) * dest_stride, dest_stride);
+	}
+}
+
+// No vectors: every pixel goes through DebayerPixel. The banded scalar path uses these, the single threaded one
+// keeps the reference above.
+static int DebayerRowRGB_Scalar(int frame_width, const uint8_t* top, const uint8_t* mid, const uint8_t* bot, uint8_t* dest, bool bg_row, bool inBGR)
+{
+	return 1;
+}
+
+static int DebayerRowGray_Scalar(int frame_width, const uint8_t* top, const uint8_t* mid, const uint8_t* bot, uint8_t* dest, bool bg_row)
+{
+	return 1;
+}
+
+static int DebayerRowPlanarRGB_Scalar(int frame_width, const uint8_t* top, const uint8_t* mid, const uint8_t* bot, uint8_t* dest_r, uint8_t* dest_g, uint8_t* dest_b, bool bg_row)
+{
+	return 1;
+}
+
+#if defined(PS3EYE_DEBAYER_X86)
+
+// SSSE3
+
+PS3EYE_TARGET("ssse3") static inline __m128i Avg4_SSSE3(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+	const __m128i zero	= _mm_setzero_si128();
+	const __m128i two	= _mm_set1_epi16(2);
+
+	__m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)),
+							   _mm_add_epi16(_mm_unpacklo_epi8(c, zero), _mm_unpacklo_epi8(d, zero)));
+	__m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)),
+							   _mm_add_epi16(_mm_unpackhi_epi8(c, zero), _mm_unpackhi_epi8(d, zero)));
+	lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+	hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+	return _mm_packus_epi16(lo, hi);
+}
+
+PS3EYE_TARGET("ssse3") static inline __m128i Select_SSSE3(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Interleave three planes of 16 pixels into 48 bytes: a0 b0 c0 a1 b1 c1 ...
+PS3EYE_TARGET("ssse3") static inline void Store3_SSSE3(uint8_t* dest, __m128i a, __m128i b, __m128i c)
+{
+	const __m128i a0 = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5);
+	const __m128i b0 = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1);
+	const __m128i c0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+	const __m128i a1 = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1);
+	const __m128i b1 = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10);
+	const __m128i c1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1);
+	const __m128i a2 = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1);
+	const __m128i b2 = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1);
+	const __m128i c2 = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15);
+
+	__m128i out0 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, a0), _mm_shuffle_epi8(b, b0)), _mm_shuffle_epi8(c, c0));
+	__m128i out1 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, a1), _mm_shuffle_epi8(b, b1)), _mm_shuffle_epi8(c, c1));
+	__m128i out2 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, a2), _mm_shuffle_epi8(b, b2)), _mm_shuffle_epi8(c, c2));
+
+	_mm_storeu_si128((__m128i*)(dest), out0);
+	_mm_storeu_si128((__m128i*)(dest + 16), out1);
+	_mm_storeu_si128((__m128i*)(dest + 32), out2);
+}
+
+// Computes R, G and B for the 16 pixels starting at odd x
+PS3EYE_TARGET("ssse3") static inline void DebayerVector_SSSE3(const uint8_t* top, const uint8_t* mid, const uint8_t* bot, int x, bool bg_row, __m128i& R, __m128i& G, __m128i& B)
+{
+	const __m128i odd = _mm_set1_epi16(0x00FF);
+
+	__m128i tl = _mm_loadu_si128((const __m128i*)(top + x - 1));
+	__m128i tc = _mm_loadu_si128((const __m128i*)(top + x));
+	__m128i tr = _mm_loadu_si128((const __m128i*)(top + x + 1));
+	__m128i ml = _mm_loadu_si128((const __m128i*)(mid + x - 1));
+	__m128i mc = _mm_loadu_si128((const __m128i*)(mid + x));
+	__m128i mr = _mm_loadu_si128((const __m128i*)(mid + x + 1));
+	__m128i bl = _mm_loadu_si128((const __m128i*)(bot + x - 1));
+	__m128i bc = _mm_loadu_si128((const __m128i*)(bot + x));
+	__m128i br = _mm_loadu_si128((const __m128i*)(bot + x + 1));
+
+	__m128i horz	= _mm_avg_epu8(ml, mr);
+	__m128i vert	= _mm_avg_epu8(tc, bc);
+	__m128i cross	= Avg4_SSSE3(tc, ml, mr, bc);
+	__m128i diag	= Avg4_SSSE3(tl, tr, bl, br);
+
+	if (bg_row)
+	{
+		B = Select_SSSE3(odd, horz, mc);
+		G = Select_SSSE3(odd, mc, cross);
+		R = Select_SSSE3(odd, vert, diag);
+	}
+	else
+	{
+		B = Select_SSSE3(odd, diag, vert);
+		G = Select_SSSE3(odd, cross, mc);
+		R = Select_SSSE3(odd, mc, horz);
+	}
+}
+
+PS3EYE_TARGET("ssse3") static int DebayerRowRGB_SSSE3(int frame_width, const uint8_t* top, const uint8_t* mid, const uint8_t* bot, uint8_t* dest, bool bg_row, bool inBGR)
+{
+	int last = DebayerLastVector(frame_width, 16);
+	if (last == 0)
+		return 1;
+
+	for (int x = 1; ; x += 16)
+	{
+		if (x > last)
+			x = last;
+
+		__m128i R, G, B;
+		DebayerVector_SSSE3(top, mid, bot, x, bg_row, R, G, B);
+		if (inBGR)
+			Store3_SSSE3(dest + x * 3, B, G, R);
+		else
+			Store3_SSSE3(dest + x * 3, R, G, B);
+		if (x == last)
+			break;
+	}
+	return last + 16;
+}
+
+PS3EYE_TARGET("ssse3") static int DebayerRowPlanarRGB_SSSE3(int frame_width, const uint8_t* top, const uint8_t* mid, const uint8_t* bot, uint8_t* dest_r, uint8_t* dest_g, uint8_t* dest_b, bool bg_row)
+{
+	int last = DebayerLastVector(frame_width, 16);
+	if (last == 0)
+		return 1;
+
+	for (int x = 1; ; x += 16)
+	{
+		if (x > last)
+			x = last;
+
+		__m128i R, G, B;
+		DebayerVector_SSSE3(top, mid, bot, x, bg_row, R, G, B);
+		_mm_storeu_si128((__m128i*)(dest_r + x), R);
+		_mm_storeu_si128((__m128i*)(dest_g + x), G);
+		_mm_storeu_si128((__m128i*)(dest_b + x), B);
+		if (x == last)
+			break;
+	}
+	return last + 16;
+}
+
+PS3EYE_TARGET("ssse3") static inline __m128i Luma_SSSE3(__m128i R, __m128i G, __m128i B)
+{
+	const __m128i zero	= _mm_setzero_si128();
+	const __m128i kr	= _mm_set1_epi16(77);
+	const __m128i kg	= _mm_set1_epi16(151);
+	const __m128i kb	= _mm_set1_epi16(28);
+
+	// 77 + 151 + 28 == 256, so the weighted sum always fits in 16 unsigned bits
+	__m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(R, zero), kr),
+											 _mm_mullo_epi16(_mm_unpacklo_epi8(G, zero), kg)),
+											 _mm_mullo_epi16(_mm_unpacklo_epi8(B, zero), kb));
+	__m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(R, zero), kr),
+											 _mm_mullo_epi16(_mm_unpackhi_epi8(G, zero), kg)),
+											 _mm_mullo_epi16(_mm_unpackhi_epi8(B, zero), kb));
+	return _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+}
+
+PS3EYE_TARGET("ssse3") static int DebayerRowGray_SSSE3(int frame_width, const uint8_t* top, const uint8_t* mid, const uint8_t* bot, uint8_t* dest, bool bg_row)
+{
+	int last = DebayerLastVector(frame_width, 16);
+	if (last == 0)
+		return 1;
+
+	for (int x = 1; ; x += 16)
+	{
+		if (x > last)
+			x = last;
+
+		__m128i R, G, B;
+		DebayerVector_SSSE3(top, mid, bot, x, bg_row, R, G, B);
+		_mm_storeu_si128((__m128i*)(dest + x), Luma_SSSE3(R, G, B));
+		if (x == last)
+			break;
+	}
+	return last + 16;
+}
+
+// Viewed as 16-bit lanes, a G R row holds G in the low and R in the high byte of every lane (B and G for the
+// other row), so a quad row deinterleaves with a mask and a shift.
+PS3EYE_TARGET("ssse3") static inline __m128i QuadLuma_SSSE3(__m128i gr, __m128i bg)
+{
+	const __m128i low	= _mm_set1_epi16(0x00FF);
+	const __m128i kr	= _mm_set1_epi16(77);
+	const __m128i kg	= _mm_set1_epi16(151);
+	const __m128i kb	= _mm_set1_epi16(28);
+
+	__m128i G = _mm_avg_epu16(_mm_and_si128(gr, low), _mm_srli_epi16(bg, 8));
+	__m128i R = _mm_srli_epi16(gr, 8);
+	__m128i B = _mm_and_si128(bg, low);
+	return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(R, kr), _mm_mullo_epi16(G, kg)), _mm_mullo_epi16(B, kb)), 8);
+}
+
+PS3EYE_TARGET("ssse3") static int DebayerRowHalfGray_SSSE3(int out_width, const uint8_t* gr, const uint8_t* bg, uint8_t* dest)
+{
+	int x = 0;
+	for (; x + 16 <= out_width; x += 16)
+	{
+		__m128i lo = QuadLuma_SSSE3(_mm_loadu_si128((const __m128i*)(gr + x * 2)),		_mm_loadu_si128((const __m128i*)(bg + x * 2)));
+		__m128i hi = QuadLuma_SSSE3(_mm_loadu_si128((const __m128i*)(gr + x * 2 + 16)),	_mm_loadu_si128((const __m128i*)(bg + x * 2 + 16)));
+		_mm_storeu_si128((__m128i*)(dest + x), _mm_packus_epi16(lo, hi));
+	}
+	return x;
+}
+
+// AVX2
+//
+// Same as SSSE3 at twice the width. Unpack and pack both work within 128-bit lanes, so widening and narrowing
+// again leaves the pixels in order; the interleaved store is done one 128-bit half at a time.
+
+PS3EYE_TARGET("avx2") static inline __m256i Avg4_AVX2(__m256i a, __m256i b, __m256i c, __m256i d)
+{
+	const __m256i zero	= _mm256_setzero_si256();
+	const __m256i two	= _mm256_set1_epi16(2);
+
+	__m256i lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero)),
+								  _mm256_add_epi16(_mm256_unpacklo_epi8(c, zero), _mm256_unpacklo_epi8(d, zero)));
+	__m256i hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero)),
+								  _mm256_add_epi16(_mm256_unpackhi_epi8(c, zero), _mm256_unpackhi_epi8(d, zero)));
+	lo = _mm256_srli_epi16(_mm256_add_epi16(lo, two), 2);
+	hi = _mm256_srli_epi16(_mm256_add_epi16(hi, two), 2);
+	return _mm256_packus_epi16(lo, hi);
+}
+
+PS3EYE_TARGET("avx2") static inline void DebayerVector_AVX2(const uint8_t* top, const uint8_t* mid, const uint8_t* bot, int x, bool bg_row, __m256i& R, __m256i& G, __m256i& B)
+{
+	const __m256i odd = _mm256_set1_epi16(0x00FF);
+
+	__m256i tl = _mm256_loadu_si256((const __m256i*)(top + x - 1));
+	__m256i tc = _mm256_loadu_si256((const __m256i*)(top + x));
+	__m256i tr = _mm256_loadu_si256((const __m256i*)(top + x + 1));
+	__m256i ml = _mm256_loadu_si256((const __m256i*)(mid + x - 1));
+	__m256i mc = _mm256_loadu_si256((const __m256i*)(mid + x));
+	__m256i mr = _mm256_loadu_si256((const __m256i*)(mid + x + 1));
+	__m256i bl = _mm256_loadu_si256((const __m256i*)(bot + x - 1));
+	__m256i bc = _mm256_loadu_si256((const __m256i*)(bot + x));
+	__m256i br = _mm256_loadu_si256((const __m256i*)(bot + x + 1));
+
+	__m256i horz	= _mm256_avg_epu8(ml, mr);
+	__m256i vert	= _mm256_avg_epu8(tc, bc);
+	__m256i cross	= Avg4_AVX2(tc, ml, mr, bc);
+	__m256i diag	= Avg4_AVX2(tl, tr, bl, br);
+
+	if (bg_row)
+	{
+		B = _mm256_blendv_epi8(mc, horz, odd);
+		G = _mm256_blendv_epi8(cross, mc, odd);
+		R = _mm256_blendv_epi8(diag, vert, odd);
+	}
+	else
+	{
+		B = _mm256_blendv_epi8(vert, diag, odd);
+		G = _mm256_blendv_epi8(mc, cross, odd);
+		R = _mm256_blendv_epi8(horz, mc, odd);
+	}
+}
+
+PS3EYE_TARGET("avx2") static int DebayerRowRGB_AVX2(int frame_width, const uint8_t* top, const uint8_t* mid, const uint8_t* bot, uint8_t* dest, bool bg_row, bool inBGR)
+{
+	int last = DebayerLastVector(frame_width, 32);
+	if (last == 0)
+		return 1;
+
+	for (int x = 1; ; x += 32)
+	{
+		if (x > last)
+			x = last;
+
+		__m256i R, G, B;
+		DebayerVector_AVX2(top, mid, bot, x, bg_row, R, G, B);
+
+		__m256i c0 = inBGR ? B : R;
+		__m256i c2 = inBGR ? R : B;
+		Store3_SSSE3(dest + x * 3,		_mm256_castsi256_si128(c0),			_mm256_castsi256_si128(G),		_mm256_castsi256_si128(c2));
+		Store3_SSSE3(dest + x * 3 + 48,	_mm256_extracti128_si256(c0, 1),	_mm256_extracti128_si256(G, 1),	_mm256_extracti128_si256(c2, 1));
+		if (x == last)
+			break;
+	}
+	return last + 32;
+}
+
+PS3EYE_TARGET("avx2") static int DebayerRowPlanarRGB_AVX2(int frame_width, const uint8_t* top, const uint8_t* mid, const uint8_t* bot, uint8_t* dest_r, uint8_t* dest_g, uint8_t* dest_b, bool bg_row)
+{
+	int last = DebayerLastVector(frame_width, 32);
+	if (last == 0)
+		return 1;
+
+	for (int x = 1; ; x += 32)
+	{
+		if (x > last)
+			x = last;
+
+		__m256i R, G, B;
+		DebayerVector_AVX2(top, mid, bot, x, bg_row, R, G, B);
+		_mm256_storeu_si256((__m256i*)(dest_r + x), R);
+		_mm256_storeu_si256((__m256i*)(dest_g + x), G);
+		_mm256_storeu_si256((__m256i*)(dest_b + x), B);
+		if (x == last)
+			break;
+	}
+	return last + 32;
+}
+
+PS3EYE_TARGET("avx2") static int DebayerRowGray_AVX2(int frame_width, const uint8_t* top, const uint8_t* mid, const uint8_t* bot, uint8_t* dest, bool bg_row)
+{
+	const __m256i zero	= _mm256_setzero_si256();
+	const __m256i kr	= _mm256_set1_epi16(77);
+	const __m256i kg	= _mm256_set1_epi16(151);
+	const __m256i kb	= _mm256_set1_epi16(28);
+
+	int last = DebayerLastVector(frame_width, 32);
+	if (last == 0)
+		return 1;
+
+	for (int x = 1; ; x += 32)
+	{
+		if (x > last)
+			x = last;
+
+		__m256i R, G, B;
+		DebayerVector_AVX2(top, mid, bot, x, bg_row, R, G, B);
+
+		__m256i lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(R, zero), kr),
+													   _mm256_mullo_epi16(_mm256_unpacklo_epi8(G, zero), kg)),
+													   _mm256_mullo_epi16(_mm256_unpacklo_epi8(B, zero), kb));
+		__m256i hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(R, zero), kr),
+													   _mm256_mullo_epi16(_mm256_unpackhi_epi8(G, zero), kg)),
+													   _mm256_mullo_epi16(_mm256_unpackhi_epi8(B, zero), kb));
+		_mm256_storeu_si256((__m256i*)(dest + x), _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8)));
+		if (x == last)
+			break;
+	}
+	return last + 32;
+}
+
+PS3EYE_TARGET("avx2") static inline __m256i QuadLuma_AVX2(__m256i gr, __m256i bg)
+{
+	const __m256i low	= _mm256_set1_epi16(0x00FF);
+	const __m256i kr	= _mm256_set1_epi16(77);
+	const __m256i kg	= _mm256_set1_epi16(151);
+	const __m256i kb	= _mm256_set1_epi16(28);
+
+	__m256i G = _mm256_avg_epu16(_mm256_and_si256(gr, low), _mm256_srli_epi16(bg, 8));
+	__m256i R = _mm256_srli_epi16(gr, 8);
+	__m256i B = _mm256_and_si256(bg, low);
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(R, kr), _mm256_mullo_epi16(G, kg)), _mm256_mullo_epi16(B, kb)), 8);
+}
+
+PS3EYE_TARGET("avx2") static int DebayerRowHalfGray_AVX2(int out_width, const uint8_t* gr, const uint8_t* bg, uint8_t* dest)
+{
+	int x = 0;
+	for (; x + 32 <= out_width; x += 32)
+	{
+		__m256i lo = QuadLuma_AVX2(_mm256_loadu_si256((const __m256i*)(gr + x * 2)),		_mm256_loadu_si256((const __m256i*)(bg + x * 2)));
+		__m256i hi = QuadLuma_AVX2(_mm256_loadu_si256((const __m256i*)(gr + x * 2 + 32)),	_mm256_loadu_si256((const __m256i*)(bg + x * 2 + 32)));
+		// packus interleaves the 128-bit lanes of its inputs, put the quads back in order
+		_mm256_storeu_si256((__m256i*)(dest + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8));
+	}
+	return x;
+}
+
+#endif // PS3EYE_DEBAYER_X86
+
+#if defined(PS3EYE_DEBAYER_NEON)
+
+// NEON
+
+static inline uint8x16_t Avg4_NEON(uint8x16_t a, uint8x16_t b, uint8x16_t c, uint8x16_t d)
+{
+	uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(a), vget_low_u8(b)), vaddl_u8(vget_low_u8(c), vget_low_u8(d)));
+	uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(a), vget_high_u8(b)), vaddl_u8(vget_high_u8(c), vget_high_u8(d)));
+	// vrshrn computes (x + 2) >> 2
+	return vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2));
+}
+
+static inline void DebayerVector_NEON(const uint8_t* top, const uint8_t* mid, const uint8_t* bot, int x, bool bg_row, uint8x16_t& R, uint8x16_t& G, uint8x16_t& B)
+{
+	const uint8x16_t odd = vreinterpretq_u8_u16(vdupq_n_u16(0x00FF));
+
+	uint8x16_t tl = vld1q_u8(top + x - 1);
+	uint8x16_t tc = vld1q_u8(top + x);
+	uint8x16_t tr = vld1q_u8(top + x + 1);
+	uint8x16_t ml = vld1q_u8(mid + x - 1);
+	uint8x16_t mc = vld1q_u8(mid + x);
+	uint8x16_t mr = vld1q_u8(mid + x + 1);
+	uint8x16_t bl = vld1q_u8(bot + x - 1);
+	uint8x16_t bc = vld1q_u8(bot + x);
+	uint8x16_t br = vld1q_u8(bot + x + 1);
+
+	// vrhadd computes (a + b + 1) >> 1
+	uint8x16_t horz		= vrhaddq_u8(ml, mr);
+	uint8x16_t vert		= vrhaddq_u8(tc, bc);
+	uint8x16_t cross	= Avg4_NEON(tc, ml, mr, bc);
+	uint8x16_t diag		= Avg4_NEON(tl, tr, bl, br);
+
+	if (bg_row)
+	{
+		B = vbslq_u8(odd, horz, mc);
+		G = vbslq_u8(odd, mc, cross);
+		R = vbslq_u8(odd, vert, diag);
+	}
+	else
+	{
+		B = vbslq_u8(odd, diag, vert);
+		G = vbslq_u8(odd, cross, mc);
+		R = vbslq_u8(odd, mc, horz);
+	}
+}
+
+static int DebayerRowRGB_NEON(int frame_width, const uint8_t* top, const uint8_t* mid, const uint8_t* bot, uint8_t* dest, bool bg_row, bool inBGR)
+{
+	int last = DebayerLastVector(frame_width, 16);
+	if (last == 0)
+		return 1;
+
+	for (int x = 1; ; x += 16)
+	{
+		if (x > last)
+			x = last;
+
+		uint8x16x3_t pixels;
+		DebayerVector_NEON(top, mid, bot, x, bg_row, pixels.val[inBGR ? 2 : 0], pixels.val[1], pixels.val[inBGR ? 0 : 2]);
+		vst3q_u8(dest + x * 3, pixels);
+		if (x == last)
+			break;
+	}
+	return last + 16;
+}
+
+static int DebayerRowPlanarRGB_NEON(int frame_width, const uint8_t* top, const uint8_t* mid, const uint8_t* bot, uint8_t* dest_r, uint8_t* dest_g, uint8_t* dest_b, bool bg_row)
+{
+	int last = DebayerLastVector(frame_width, 16);
+	if (last == 0)
+		return 1;
+
+	for (int x = 1; ; x += 16)
+	{
+		if (x > last)
+			x = last;
+
+		uint8x16_t R, G, B;
+		DebayerVector_NEON(top, mid, bot, x, bg_row, R, G, B);
+		vst1q_u8(dest_r + x, R);
+		vst1q_u8(dest_g + x, G);
+		vst1q_u8(dest_b + x, B);
+		if (x == last)
+			break;
+	}
+	return last + 16;
+}
+
+static int DebayerRowGray_NEON(int frame_width, const uint8_t* top, const uint8_t* mid, const uint8_t* bot, uint8_t* dest, bool bg_row)
+{
+	int last = DebayerLastVector(frame_width, 16);
+	if (last == 0)
+		return 1;
+
+	for (int x = 1; ; x += 16)
+	{
+		if (x > last)
+			x = last;
+
+		uint8x16_t R, G, B;
+		DebayerVector_NEON(top, mid, bot, x, bg_row, R, G, B);
+
+		uint16x8_t lo = vmull_u8(vget_low_u8(R), vdup_n_u8(77));
+		lo = vmlal_u8(lo, vget_low_u8(G), vdup_n_u8(151));
+		lo = vmlal_u8(lo, vget_low_u8(B), vdup_n_u8(28));
+		uint16x8_t hi = vmull_u8(vget_high_u8(R), vdup_n_u8(77));
+		hi = vmlal_u8(hi, vget_high_u8(G), vdup_n_u8(151));
+		hi = vmlal_u8(hi, vget_high_u8(B), vdup_n_u8(28));
+		vst1q_u8(dest + x, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+		if (x == last)
+			break;
+	}
+	return last + 16;
+}
+
+static int DebayerRowHalfGray_NEON(int out_width, const uint8_t* gr, const uint8_t* bg, uint8_t* dest)
+{
+	int x = 0;
+	for (; x + 16 <= out_width; x += 16)
+	{
+		// vld2 deinterleaves even and odd columns
+		uint8x16x2_t top = vld2q_u8(gr + x * 2);
+		uint8x16x2_t bot = vld2q_u8(bg + x * 2);
+		uint8x16_t G = vrhaddq_u8(top.val[0], bot.val[1]);
+		uint8x16_t R = top.val[1];
+		uint8x16_t B = bot.val[0];
+
+		uint16x8_t lo = vmull_u8(vget_low_u8(R), vdup_n_u8(77));
+		lo = vmlal_u8(lo, vget_low_u8(G), vdup_n_u8(151));
+		lo = vmlal_u8(lo, vget_low_u8(B), vdup_n_u8(28));
+		uint16x8_t hi = vmull_u8(vget_high_u8(R), vdup_n_u8(77));
+		hi = vmlal_u8(hi, vget_high_u8(G), vdup_n_u8(151));
+		hi = vmlal_u8(hi, vget_high_u8(B), vdup_n_u8(28));
+		vst1q_u8(dest + x, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+	}
+	return x;
+}
+
+#endif // PS3EYE_DEBAYER_NEON
+
+// Kernel selection
+
+bool DebayerKernelSupported(EDebayerKernel kernel)
+{
+	switch (kernel)
+	{
+	case EDebayerKernel::Scalar:
+		return true;
+#if defined(PS3EYE_DEBAYER_X86)
+	case EDebayerKernel::SSSE3:
+		return __builtin_cpu_supports("ssse3") != 0;
+	case EDebayerKernel::AVX2:
+		return __builtin_cpu_supports("avx2") != 0;
+#endif
+#if defined(PS3EYE_DEBAYER_NEON)
+	case EDebayerKernel::NEON:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+const char* DebayerKernelName(EDebayerKernel kernel)
+{
+	switch (kernel)
+	{
+	case EDebayerKernel::Scalar:	return "scalar";
+	case EDebayerKernel::SSSE3:		return "ssse3";
+	case EDebayerKernel::AVX2:		return "avx2";
+	case EDebayerKernel::NEON:		return "neon";
+	}
+	return "unknown";
+}
+
+EDebayerKernel DebayerDetectKernel()
+{
+	if (DebayerKernelSupported(EDebayerKernel::AVX2))
+		return EDebayerKernel::AVX2;
+	if (DebayerKernelSupported(EDebayerKernel::SSSE3))
+		return EDebayerKernel::SSSE3;
+	if (DebayerKernelSupported(EDebayerKernel::NEON))
+		return EDebayerKernel::NEON;
+	return EDebayerKernel::Scalar;
+}
+
+static std::atomic<EDebayerKernel>& CurrentKernel()
+{
+	static std::atomic<EDebayerKernel> kernel(DebayerDetectKernel());
+	return kernel;
+}
+
+EDebayerKernel DebayerGetKernel()
+{
+	return CurrentKernel().load(std::memory_order_relaxed);
+}
+
+bool DebayerSetKernel(EDebayerKernel kernel)
+{
+	if (!DebayerKernelSupported(kernel))
+		return false;
+	CurrentKernel().store(kernel, std::memory_order_relaxed);
+	return true;
+}
+
+// Banding
+//
+// Output rows only depend on the source, so a frame splits into horizontal bands that are debayered independently.
+// The calling thread takes bands too, and DebayerBands returns once all of them are done. Only one frame uses the
+// workers at a time; a second camera's thread that finds them busy does its whole frame itself.
+
+#define DEBAYER_MAX_THREADS		16
+#define DEBAYER_MIN_BAND_PIXELS	32768	// below this a band costs less than waking a worker
+
+class DebayerPool
+{
+public:
+	~DebayerPool()
+	{
+		std::lock_guard<std::mutex> run_lock(run_mutex);
+		stop_workers();
+	}
+
+	int GetThreads()
+	{
+		return thread_count.load(std::memory_order_relaxed);
+	}
+
+	void SetThreads(int threads)
+	{
+		std::lock_guard<std::mutex> run_lock(run_mutex);
+		stop_workers();
+		for (int i = 1; i < threads; ++i)
+			workers.emplace_back(&DebayerPool::worker_loop, this, generation);
+		thread_count.store(threads, std::memory_order_relaxed);
+	}
+
+	void Run(int bands, const std::function<void(int)>& band_fn)
+	{
+		std::unique_lock<std::mutex> run_lock(run_mutex, std::try_to_lock);
+		if (!run_lock.owns_lock() || workers.empty() || bands < 2)
+		{
+			for (int band = 0; band < bands; ++band)
+				band_fn(band);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job			= &band_fn;
+			job_bands	= bands;
+			next_band	= 0;
+			active		= (int)workers.size();
+			++generation;
+		}
+		start_cv.notify_all();
+
+		run_bands();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done_cv.wait(lock, [this] { return active == 0; });
+		job = NULL;
+	}
+
+private:
+	void run_bands()
+	{
+		for (int band = next_band++; band < job_bands; band = next_band++)
+			(*job)(band);
+	}
+
+	// Starts from the generation at creation rather than whatever it is once the thread runs, or a frame posted
+	// in between would never be picked up
+	void worker_loop(uint64_t seen)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;)
+		{
+			start_cv.wait(lock, [this, seen] { return exiting || generation != seen; });
+			if (exiting)
+				return;
+			seen = generation;
+
+			lock.unlock();
+			run_bands();
+			lock.lock();
+
+			if (--active == 0)
+				done_cv.notify_one();
+		}
+	}
+
+	// Caller holds run_mutex, so no frame is in flight
+	void stop_workers()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			exiting = true;
+		}
+		start_cv.notify_all();
+		for (std::thread& worker : workers)
+			worker.join();
+		workers.clear();
+		exiting = false;
+	}
+
+	std::mutex								run_mutex;	// held for a whole frame
+	std::mutex								mutex;
+	std::condition_variable					start_cv;
+	std::condition_variable					done_cv;
+	std::vector<std::thread>				workers;
+	const std::function<void(int)>*			job = NULL;
+	int										job_bands = 0;
+	std::atomic<int>						next_band{0};
+	int										active = 0;
+	uint64_t								generation = 0;
+	bool									exiting = false;
+	std::atomic<int>						thread_count{1};	// workers plus the caller
+};
+
+static DebayerPool& BandPool()
+{
+	static DebayerPool pool;
+	return pool;
+}
+
+int DebayerGetThreads()
+{
+	return BandPool().GetThreads();
+}
+
+void DebayerSetThreads(int threads)
+{
+	if (threads < 1)
+		threads = 1;
+	if (threads > DEBAYER_MAX_THREADS)
+		threads = DEBAYER_MAX_THREADS;
+	BandPool().SetThreads(threads);
+}
+
+// Number of bands worth splitting a frame into, 1 to debayer it in one go
+static int DebayerBandCount(int frame_width, int frame_height)
+{
+	int bands = DebayerGetThreads();
+	int by_size = (frame_width * frame_height) / DEBAYER_MIN_BAND_PIXELS;
+	if (bands > by_size)
+		bands = by_size;
+	if (bands > frame_height / 2)
+		bands = frame_height / 2;
+	return bands > 1 ? bands : 1;
+}
+
+// Calls rows_fn(y_begin, y_end) for each band. Bands are at least two rows high (see the row drivers).
+static void DebayerBands(int frame_height, int bands, const std::function<void(int, int)>& rows_fn)
+{
+	BandPool().Run(bands, [&](int band) {
+		rows_fn(frame_height * band / bands, frame_height * (band + 1) / bands);
+	});
+}
+
+void DebayerRGB(EDebayerKernel kernel, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool inBGR)
+{
+	DebayerRowRGBFn row_fn = DebayerRowRGB_Scalar;
+	switch (kernel)
+	{
+#if defined(PS3EYE_DEBAYER_X86)
+	case EDebayerKernel::SSSE3:
+		row_fn = DebayerRowRGB_SSSE3;
+		break;
+	case EDebayerKernel::AVX2:
+		row_fn = DebayerRowRGB_AVX2;
+		break;
+#endif
+#if defined(PS3EYE_DEBAYER_NEON)
+	case EDebayerKernel::NEON:
+		row_fn = DebayerRowRGB_NEON;
+		break;
+#endif
+	default:
+		break;
+	}
+
+	int bands = DebayerBandCount(frame_width, frame_height);
+	if (bands == 1)
+	{
+		if (row_fn == DebayerRowRGB_Scalar)
+			DebayerRGBScalar(frame_width, frame_height, inBayer, outBuffer, inBGR);
+		else
+			DebayerRowsRGB(row_fn, frame_width, frame_height, 0, frame_height, inBayer, outBuffer, inBGR);
+		return;
+	}
+
+	DebayerBands(frame_height, bands, [&](int y_begin, int y_end) {
+		DebayerRowsRGB(row_fn, frame_width, frame_height, y_begin, y_end, inBayer, outBuffer, inBGR);
+	});
+}
+
+void DebayerRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool inBGR)
+{
+	DebayerRGB(DebayerGetKernel(), frame_width, frame_height, inBayer, outBuffer, inBGR);
+}
+
+void DebayerGray(EDebayerKernel kernel, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer)
+{
+	DebayerRowGrayFn row_fn = DebayerRowGray_Scalar;
+	switch (kernel)
+	{
+#if defined(PS3EYE_DEBAYER_X86)
+	case EDebayerKernel::SSSE3:
+		row_fn = DebayerRowGray_SSSE3;
+		break;
+	case EDebayerKernel::AVX2:
+		row_fn = DebayerRowGray_AVX2;
+		break;
+#endif
+#if defined(PS3EYE_DEBAYER_NEON)
+	case EDebayerKernel::NEON:
+		row_fn = DebayerRowGray_NEON;
+		break;
+#endif
+	default:
+		break;
+	}
+
+	int bands = DebayerBandCount(frame_width, frame_height);
+	if (bands == 1)
+	{
+		if (row_fn == DebayerRowGray_Scalar)
+			DebayerGrayScalar(frame_width, frame_height, inBayer, outBuffer);
+		else
+			DebayerRowsGray(row_fn, frame_width, frame_height, 0, frame_height, inBayer, outBuffer);
+		return;
+	}
+
+	DebayerBands(frame_height, bands, [&](int y_begin, int y_end) {
+		DebayerRowsGray(row_fn, frame_width, frame_height, y_begin, y_end, inBayer, outBuffer);
+	});
+}
+
+void DebayerGray(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer)
+{
+	DebayerGray(DebayerGetKernel(), frame_width, frame_height, inBayer, outBuffer);
+}
+
+void DebayerHalfGray(EDebayerKernel kernel, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer)
+{
+	switch (kernel)
+	{
+#if defined(PS3EYE_DEBAYER_X86)
+	case EDebayerKernel::SSSE3:
+		DebayerRowsHalfGray(DebayerRowHalfGray_SSSE3, frame_width, frame_height, inBayer, outBuffer);
+		return;
+	case EDebayerKernel::AVX2:
+		DebayerRowsHalfGray(DebayerRowHalfGray_AVX2, frame_width, frame_height, inBayer, outBuffer);
+		return;
+#endif
+#if defined(PS3EYE_DEBAYER_NEON)
+	case EDebayerKernel::NEON:
+		DebayerRowsHalfGray(DebayerRowHalfGray_NEON, frame_width, frame_height, inBayer, outBuffer);
+		return;
+#endif
+	default:
+		DebayerHalfGrayScalar(frame_width, frame_height, inBayer, outBuffer);
+		return;
+	}
+}
+
+void DebayerHalfGray(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer)
+{
+	DebayerHalfGray(DebayerGetKernel(), frame_width, frame_height, inBayer, outBuffer);
+}
+
+void DebayerPlanarRGB(EDebayerKernel kernel, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer)
+{
+	DebayerRowPlanarFn row_fn = DebayerRowPlanarRGB_Scalar;
+	switch (kernel)
+	{
+#if defined(PS3EYE_DEBAYER_X86)
+	case EDebayerKernel::SSSE3:
+		row_fn = DebayerRowPlanarRGB_SSSE3;
+		break;
+	case EDebayerKernel::AVX2:
+		row_fn = DebayerRowPlanarRGB_AVX2;
+		break;
+#endif
+#if defined(PS3EYE_DEBAYER_NEON)
+	case EDebayerKernel::NEON:
+		row_fn = DebayerRowPlanarRGB_NEON;
+		break;
+#endif
+	default:
+		break;
+	}
+
+	int bands = DebayerBandCount(frame_width, frame_height);
+	if (bands == 1)
+	{
+		DebayerRowsPlanarRGB(row_fn, frame_width, frame_height, 0, frame_height, inBayer, outBuffer);
+		return;
+	}
+
+	DebayerBands(frame_height, bands, [&](int y_begin, int y_end) {
+		DebayerRowsPlanarRGB(row_fn, frame_width, frame_height, y_begin, y_end, inBayer, outBuffer);
+	});
+}
+
+void DebayerPlanarRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer)
+{
+	DebayerPlanarRGB(DebayerGetKernel(), frame_width, frame_height, inBayer, outBuffer);
+}
+
+void DebayerYUV420(EDebayerKernel kernel, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool interleavedUV)
+{
+	int		plane_size	= frame_width * frame_height;
+	uint8_t* chroma		= outBuffer + plane_size;
+
+	DebayerGray(kernel, frame_width, frame_height, inBayer, outBuffer);
+	if (interleavedUV)
+		DebayerChroma420(frame_width, frame_height, 1, inBayer, chroma, chroma + 1, 2);
+	else
+		DebayerChroma420(frame_width, frame_height, 1, inBayer, chroma, chroma + plane_size / 4, 1);
+}
+
+void DebayerYUV420(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool interleavedUV)
+{
+	DebayerYUV420(DebayerGetKernel(), frame_width, frame_height, inBayer, outBuffer, interleavedUV);
+}
+
+void DebayerHalfRGB(EDebayerKernel kernel, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool inBGR)
+{
+	DebayerHalfRGBScalar(frame_width, frame_height, inBayer, outBuffer, inBGR);
+}
+
+void DebayerHalfRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool inBGR)
+{
+	DebayerHalfRGB(DebayerGetKernel(), frame_width, frame_height, inBayer, outBuffer, inBGR);
+}
+
+void DebayerHalfPlanarRGB(EDebayerKernel kernel, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer)
+{
+	DebayerHalfPlanarRGBScalar(frame_width, frame_height, inBayer, outBuffer);
+}
+
+void DebayerHalfPlanarRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer)
+{
+	DebayerHalfPlanarRGB(DebayerGetKernel(), frame_width, frame_height, inBayer, outBuffer);
+}
+
+void DebayerHalfYUV420(EDebayerKernel kernel, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool interleavedUV)
+{
+	int		plane_size	= (frame_width / 2) * (frame_height / 2);
+	uint8_t* chroma		= outBuffer + plane_size;
+
+	DebayerHalfGray(kernel, frame_width, frame_height, inBayer, outBuffer);
+	if (interleavedUV)
+		DebayerChroma420(frame_width, frame_height, 2, inBayer, chroma, chroma + 1, 2);
+	else
+		DebayerChroma420(frame_width, frame_height, 2, inBayer, chroma, chroma + plane_size / 4, 1);
+}
+
+void DebayerHalfYUV420(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool interleavedUV)
+{
+	DebayerHalfYUV420(DebayerGetKernel(), frame_width, frame_height, inBayer, outBuffer, interleavedUV);
+}
+
+} // namespace
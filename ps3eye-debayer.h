@@ -0,0 +1,72 @@
+// Debayer kernels for the GRBG output of the PS3 Eye's OV772x sensor
+#ifndef PS3EYE_DEBAYER_H
+#define PS3EYE_DEBAYER_H
+
+#include <stdint.h>
+
+namespace ps3eye {
+
+enum class EDebayerKernel
+{
+	Scalar,					// Portable reference implementation
+	SSSE3,					// x86, 16 pixels per step
+	AVX2,					// x86, 32 pixels per step
+	NEON					// ARM, 16 pixels per step
+};
+
+// Every kernel produces output that is bit-identical to the scalar reference.
+// The SIMD kernels are compiled in whenever the compiler supports them and are
+// only selected when the running CPU does too.
+
+bool DebayerKernelSupported(EDebayerKernel kernel);
+const char* DebayerKernelName(EDebayerKernel kernel);
+
+// Fastest kernel supported by the running CPU.
+EDebayerKernel DebayerDetectKernel();
+
+// Kernel used by the overloads below (and so by PS3EYECam::getFrame). Defaults to DebayerDetectKernel().
+// Returns false, leaving the current kernel in place, if the requested kernel is not supported.
+EDebayerKernel DebayerGetKernel();
+bool DebayerSetKernel(EDebayerKernel kernel);
+
+// Threads used by DebayerRGB, DebayerGray, DebayerPlanarRGB and the luma of DebayerYUV420, for any kernel. Each frame
+// is split into horizontal bands, with the calling thread working on them alongside threads - 1 pooled workers; the
+// output is the same as with one thread. Defaults to 1. Small frames use fewer bands, QVGA
+// at most two. With several cameras only one frame at a time is banded; the others debayer on their own thread.
+int DebayerGetThreads();
+void DebayerSetThreads(int threads);
+
+// Destination buffer must be width * height * 3 bytes
+void DebayerRGB(EDebayerKernel kernel, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool inBGR);
+void DebayerRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool inBGR);
+
+// Destination buffer must be width * height bytes
+void DebayerGray(EDebayerKernel kernel, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer);
+void DebayerGray(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer);
+
+// One grayscale pixel per 2x2 GRBG quad, without interpolation. Destination buffer must be width/2 * height/2 bytes
+void DebayerHalfGray(EDebayerKernel kernel, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer);
+void DebayerHalfGray(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer);
+
+// Three width * height planes, R then G then B. Destination buffer must be width * height * 3 bytes
+void DebayerPlanarRGB(EDebayerKernel kernel, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer);
+void DebayerPlanarRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer);
+
+// YUV 4:2:0, full range BT.601 (JPEG) with the luma of DebayerGray. A width * height Y plane, then width/2 * height/2
+// U and V planes (I420) or one plane of interleaved U V pairs (NV12). Chroma comes straight from each 2x2 quad
+// rather than from the interpolated pixels. Destination buffer must be width * height * 3 / 2 bytes
+void DebayerYUV420(EDebayerKernel kernel, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool interleavedUV);
+void DebayerYUV420(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool interleavedUV);
+
+// Half resolution variants, one pixel per quad like DebayerHalfGray. The sizes above apply to width/2 x height/2;
+// for YUV 4:2:0 each chroma sample averages 2x2 quads. Only the luma of DebayerHalfYUV420 has SIMD kernels.
+void DebayerHalfRGB(EDebayerKernel kernel, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool inBGR);
+void DebayerHalfRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool inBGR);
+void DebayerHalfPlanarRGB(EDebayerKernel kernel, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer);
+void DebayerHalfPlanarRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer);
+void DebayerHalfYUV420(EDebayerKernel kernel, int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool interleavedUV);
+void DebayerHalfYUV420(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool interleavedUV);
+
+} // namespace
+
+#endif
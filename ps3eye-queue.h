@@ -0,0 +1,455 @@
+// Frame queue between the USB transfer thread and the consumer of a PS3EYECam, and the lock-free parts it is made
+// of. Internal to the driver; ps3eye-bench includes it to time the handoff.
+#ifndef PS3EYE_QUEUE_H
+#define PS3EYE_QUEUE_H
+
+#include "ps3eye.h"
+#include "ps3eye-debayer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#if defined WIN32 || defined _WIN32 || defined WINCE
+	#include <malloc.h>
+#elif defined __linux__
+	#include <climits>
+	#include <unistd.h>
+	#include <sys/syscall.h>
+	#include <linux/futex.h>
+#endif
+
+namespace ps3eye {
+
+#define CACHE_LINE_SIZE		64
+#define BUFFER_ALIGNMENT	4096	/* page */
+
+static inline void* aligned_malloc(size_t size, size_t alignment)
+{
+#if defined WIN32 || defined _WIN32 || defined WINCE
+	return _aligned_malloc(size, alignment);
+#else
+	void* ptr = NULL;
+	if (posix_memalign(&ptr, alignment, size) != 0)
+		return NULL;
+	return ptr;
+#endif
+}
+
+static inline void aligned_free(void* ptr)
+{
+#if defined WIN32 || defined _WIN32 || defined WINCE
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+// Lets the frame consumer sleep until the producer has published something. Notify() is called from the USB
+// transfer thread, so it never blocks and costs one atomic increment unless a consumer is actually parked.
+//
+// The consumer snapshots the sequence number, registers as a waiter, re-checks its condition and then sleeps until
+// the sequence moves on. Both sides go through seq_cst operations on sequence and waiters, so either the consumer
+// sees the new sequence, or the producer sees the waiter and wakes it.
+class FrameSignal
+{
+public:
+	FrameSignal() :
+		sequence			(0),
+		waiters				(0)
+	{
+	}
+
+	void Notify()
+	{
+		sequence.fetch_add(1);
+		if (waiters.load() != 0)
+			Unpark();
+	}
+
+	template<typename Predicate>
+	void Wait(Predicate ready)
+	{
+		while (!ready())
+		{
+			uint32_t observed = sequence.load();
+			waiters.fetch_add(1);
+			if (!ready())
+				Park(observed);
+			waiters.fetch_sub(1);
+		}
+	}
+
+private:
+#if defined(__linux__)
+	// A futex on the sequence number itself: the kernel only puts us to sleep if it still equals observed
+	void Park(uint32_t observed)
+	{
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&sequence), FUTEX_WAIT_PRIVATE, observed, NULL, NULL, 0);
+	}
+
+	void Unpark()
+	{
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&sequence), FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+	}
+#else
+	// No futex here; fall back to a condition variable. The producer only takes the mutex when a consumer is parked,
+	// and then only for as long as it takes the consumer to finish going to sleep.
+	void Park(uint32_t observed)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.wait(lock, [this, observed] () { return sequence.load() != observed; });
+	}
+
+	void Unpark()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		condition.notify_all();
+	}
+
+	std::mutex				mutex;
+	std::condition_variable	condition;
+#endif
+
+	std::atomic<uint32_t>	sequence;
+	std::atomic<uint32_t>	waiters;
+};
+
+// Fixed-capacity ring of frame buffer indices. Only one thread may Push, but Pop claims entries with a CAS on tail so
+// it can be called from both ends of the FrameQueue. A Pop that loses the CAS may have read a slot that Push has
+// since reused, which is why the slots are atomics; the value it read is thrown away with the failed CAS.
+class FrameIndexRing
+{
+public:
+	FrameIndexRing(uint32_t capacity) :
+		indices				(capacity),
+		head				(0),
+		tail				(0)
+	{
+		for (std::atomic<uint32_t>& slot : indices)
+			slot.store(0, std::memory_order_relaxed);
+	}
+
+	bool Empty() const
+	{
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+
+	void Push(uint32_t index)
+	{
+		uint32_t cur_head = head.load(std::memory_order_relaxed);
+		indices[cur_head % indices.size()].store(index, std::memory_order_relaxed);
+		head.store(cur_head + 1, std::memory_order_release);
+	}
+
+	bool Pop(uint32_t& index)
+	{
+		uint32_t cur_tail = tail.load(std::memory_order_acquire);
+		for (;;)
+		{
+			if (cur_tail == head.load(std::memory_order_acquire))
+				return false;
+
+			// Published by the release store of head that the acquire load above saw
+			index = indices[cur_tail % indices.size()].load(std::memory_order_relaxed);
+			if (tail.compare_exchange_weak(cur_tail, cur_tail + 1, std::memory_order_acq_rel, std::memory_order_acquire))
+				return true;
+		}
+	}
+
+private:
+	std::vector<std::atomic<uint32_t> > indices;
+	std::atomic<uint32_t>	head;
+	std::atomic<uint32_t>	tail;
+};
+
+// Single-producer (USB transfer thread) / single-consumer (getFrame) queue of frame buffers.
+//
+// The producer owns one buffer at a time and writes USB payloads straight into it. Completed buffers are handed to the
+// consumer through the ready ring and come back through the free ring once the consumer is done reading them, so
+// neither side ever touches a buffer the other one owns and no locks are needed. What happens when the producer
+// completes a frame and there is no free buffer to continue in is decided by the drop policy.
+class FrameQueue
+{
+public:
+	FrameQueue(uint32_t frame_capacity, uint32_t queue_depth, PS3EYECam::EDropPolicy drop_policy) :
+		frame_capacity		(frame_capacity),
+		frame_stride		((frame_capacity + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE),
+		num_frames			((std::max)(queue_depth, 2u)),
+		drop_policy			(drop_policy),
+		frame_buffer		((uint8_t*)aligned_malloc(frame_stride * num_frames, BUFFER_ALIGNMENT)),
+		frame_info			(num_frames),
+		ready_frames		(num_frames),
+		free_frames			(num_frames),
+		write_frame			(0),
+		disconnected		(false),
+		frames_produced		(0),
+		frames_delivered	(0),
+		frames_dropped		(0)
+	{
+		for (uint32_t index = 1; index < num_frames; ++index)
+			free_frames.Push(index);
+	}
+
+	~FrameQueue()
+	{
+		aligned_free(frame_buffer);
+	}
+
+	uint8_t* GetFrameBufferStart()
+	{
+		return GetFrame(write_frame);
+	}
+
+	// Producer only. Hands the frame that was just completed to the consumer, along with its timing, and returns the
+	// buffer to write the next frame into. Wait-free. Under BlockProducer that is NULL when the consumer still holds every
+	// other buffer: the producer must stop writing until ResumeWriting hands it one.
+	uint8_t* Enqueue(const PS3EYECam::FrameInfo& info)
+	{
+		// Published together with the buffer index by ready_frames.Push
+		frame_info[write_frame] = info;
+		frame_info[write_frame].sequence = frames_produced.fetch_add(1, std::memory_order_relaxed);
+
+		uint32_t next_frame = NO_FRAME;
+		if (!free_frames.Pop(next_frame))
+		{
+			// The consumer is not reading data fast enough
+			switch (drop_policy)
+			{
+			case PS3EYECam::EDropPolicy::DropNewest:
+				// Unlike traditional producer/consumer, we don't block the producer if the buffer is full.
+				// Instead, we simply return the current frame pointer, causing the producer to overwrite the frame it just completed.
+				// This allows performance to degrade gracefully: if the consumer is not fast enough (< Camera FPS), it will miss frames, but if it is fast enough (>= Camera FPS), it will see everything.
+				frames_dropped.fetch_add(1, std::memory_order_relaxed);
+				return GetFrame(write_frame);
+
+			case PS3EYECam::EDropPolicy::DropOldest:
+			case PS3EYECam::EDropPolicy::LatestOnly:
+				// Recycle the oldest frame still waiting for the consumer. If there is none left (the consumer claimed it
+				// in the meantime, or is reading the only other buffer), fall back to a buffer it has just freed or to
+				// overwriting the frame we just completed.
+				if (ready_frames.Pop(next_frame))
+				{
+					frames_dropped.fetch_add(1, std::memory_order_relaxed);
+				}
+				else if (!free_frames.Pop(next_frame))
+				{
+					frames_dropped.fetch_add(1, std::memory_order_relaxed);
+					return GetFrame(write_frame);
+				}
+				break;
+
+			case PS3EYECam::EDropPolicy::BlockProducer:
+				// Nothing that reached the queue is ever lost: publish the frame and leave the producer without a
+				// buffer. It stops resubmitting transfers until the consumer frees one, so the camera drops data on its
+				// side instead. Waiting here would hold up the USB thread, and every other camera with it.
+				next_frame = NO_FRAME;
+				break;
+			}
+		}
+
+		// Note: we don't need to copy any data to the buffer since the USB packets are directly written to the frame buffer.
+		// We just need to publish it to signal to the consumer that a new frame is available
+		ready_frames.Push(write_frame);
+		write_frame = next_frame;
+
+		// Wake the consumer if it is waiting for data
+		ready_signal.Notify();
+
+		return write_frame != NO_FRAME ? GetFrame(write_frame) : NULL;
+	}
+
+	// Producer only, after Enqueue returned NULL. The buffer to continue writing in once the consumer has freed one,
+	// NULL until then.
+	uint8_t* ResumeWriting()
+	{
+		if (write_frame == NO_FRAME)
+		{
+			uint32_t frame;
+			if (!free_frames.Pop(frame))
+				return NULL;
+			write_frame = frame;
+		}
+		return GetFrame(write_frame);
+	}
+
+	// Consumer only. Returns false if the camera went away
+	bool Dequeue(uint8_t* new_frame, PS3EYECam::EOutputFormat outputFormat, PS3EYECam::FrameInfo* info)
+	{		
+		// The claimed buffer is ours until it is released, so the producer can't write into it while we convert
+		uint32_t frame = Claim();
+		if (frame == NO_FRAME)
+			return false;
+		uint8_t* source = GetFrame(frame);
+		if (info != NULL)
+			*info = GetFrameInfo(frame);
+
+		// Frames queued before a reconfigure keep the size they were captured with
+		int frame_width = GetFrameInfo(frame).width;
+		int frame_height = GetFrameInfo(frame).height;
+
+		// Copy from internal buffer
+		if (outputFormat == PS3EYECam::EOutputFormat::Bayer)
+		{
+			memcpy(new_frame, source, frame_width * frame_height);
+		}
+		else if (outputFormat == PS3EYECam::EOutputFormat::BGR ||
+				 outputFormat == PS3EYECam::EOutputFormat::RGB)
+		{
+			DebayerRGB(frame_width, frame_height, source, new_frame, outputFormat == PS3EYECam::EOutputFormat::BGR);
+		}		
+		else if (outputFormat == PS3EYECam::EOutputFormat::Gray)
+		{
+			DebayerGray(frame_width, frame_height, source, new_frame);
+		}
+		else if (outputFormat == PS3EYECam::EOutputFormat::HalfGray)
+		{
+			DebayerHalfGray(frame_width, frame_height, source, new_frame);
+		}
+		else if (outputFormat == PS3EYECam::EOutputFormat::PlanarRGB)
+		{
+			DebayerPlanarRGB(frame_width, frame_height, source, new_frame);
+		}
+		else if (outputFormat == PS3EYECam::EOutputFormat::I420 ||
+				 outputFormat == PS3EYECam::EOutputFormat::NV12)
+		{
+			DebayerYUV420(frame_width, frame_height, source, new_frame, outputFormat == PS3EYECam::EOutputFormat::NV12);
+		}
+		else if (outputFormat == PS3EYECam::EOutputFormat::HalfBGR ||
+				 outputFormat == PS3EYECam::EOutputFormat::HalfRGB)
+		{
+			DebayerHalfRGB(frame_width, frame_height, source, new_frame, outputFormat == PS3EYECam::EOutputFormat::HalfBGR);
+		}
+		else if (outputFormat == PS3EYECam::EOutputFormat::HalfPlanarRGB)
+		{
+			DebayerHalfPlanarRGB(frame_width, frame_height, source, new_frame);
+		}
+		else if (outputFormat == PS3EYECam::EOutputFormat::HalfI420 ||
+				 outputFormat == PS3EYECam::EOutputFormat::HalfNV12)
+		{
+			DebayerHalfYUV420(frame_width, frame_height, source, new_frame, outputFormat == PS3EYECam::EOutputFormat::HalfNV12);
+		}
+
+		Release(frame);
+		return true;
+	}
+
+	// Producer only. Whether completing a frame now would find a free buffer to continue in, i.e. the drop policy
+	// would not have to step in.
+	bool HasFreeFrame() const
+	{
+		return !free_frames.Empty();
+	}
+
+	// Under BlockProducer, called on the consumer's thread each time it frees a buffer so a producer that ran out can
+	// pick up again. Replacing it waits for a call in progress to return, so clearing it guarantees no further calls.
+	void SetFreeCallback(std::function<void()> callback)
+	{
+		std::lock_guard<std::mutex> lock(free_callback_mutex);
+		free_callback = callback;
+	}
+
+	// No more frames are coming: a consumer waiting for one gets NO_FRAME once the frames already queued are gone
+	void Disconnect()
+	{
+		disconnected.store(true);
+		ready_signal.Notify();
+	}
+
+	PS3EYECam::QueueStats GetStats() const
+	{
+		PS3EYECam::QueueStats stats;
+		stats.produced	= frames_produced.load(std::memory_order_relaxed);
+		stats.delivered	= frames_delivered.load(std::memory_order_relaxed);
+		stats.dropped	= frames_dropped.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+	// Largest frame the buffers hold
+	uint32_t GetFrameCapacity() const
+	{
+		return frame_capacity;
+	}
+
+	uint8_t* GetFrame(uint32_t index)
+	{
+		return frame_buffer + frame_stride * index;
+	}
+
+	// Only valid while the caller owns the buffer, i.e. between Claim and Release
+	const PS3EYECam::FrameInfo& GetFrameInfo(uint32_t index) const
+	{
+		return frame_info[index];
+	}
+
+	static const uint32_t NO_FRAME = UINT32_MAX;
+
+	// Consumer only. Blocks until a frame is available and returns its buffer index. The buffer belongs to the caller
+	// until it is handed back with Release. Returns NO_FRAME after Disconnect.
+	uint32_t Claim()
+	{
+		for (;;)
+		{
+			// If there is no data in the buffer, wait until data becomes available
+			ready_signal.Wait([this] () { return !ready_frames.Empty() || disconnected.load(); });
+
+			uint32_t frame;
+			if (!ready_frames.Pop(frame))
+			{
+				if (disconnected.load() && ready_frames.Empty())
+					return NO_FRAME;
+				continue;	// The producer recycled it before we got to it
+			}
+
+			// Only the newest frame is of interest, skip the rest
+			if (drop_policy == PS3EYECam::EDropPolicy::LatestOnly && !ready_frames.Empty())
+			{
+				frames_dropped.fetch_add(1, std::memory_order_relaxed);
+				Release(frame);
+				continue;
+			}
+
+			frames_delivered.fetch_add(1, std::memory_order_relaxed);
+			return frame;
+		}
+	}
+
+	void Release(uint32_t frame)
+	{
+		free_frames.Push(frame);
+		if (drop_policy == PS3EYECam::EDropPolicy::BlockProducer)
+		{
+			std::lock_guard<std::mutex> lock(free_callback_mutex);
+			if (free_callback)
+				free_callback();
+		}
+	}
+
+private:
+	uint32_t				frame_capacity;
+	uint32_t				frame_stride;		// Frames start on a cache line so the debayer kernels never straddle one
+	uint32_t				num_frames;
+	PS3EYECam::EDropPolicy	drop_policy;
+
+	uint8_t*				frame_buffer;
+	std::vector<PS3EYECam::FrameInfo> frame_info;	// Timing of the frame in each buffer, owned like the buffer itself
+	FrameIndexRing			ready_frames;		// Completed frames, oldest first. Pushed by the producer, popped by both
+	FrameIndexRing			free_frames;		// Buffers the consumer is done with. Pushed by the consumer, popped by the producer
+	uint32_t				write_frame;		// Buffer the producer is currently writing
+
+	FrameSignal				ready_signal;		// Consumer waits for ready_frames
+	std::mutex				free_callback_mutex;
+	std::function<void()>	free_callback;		// See SetFreeCallback
+	std::atomic_bool		disconnected;		// Set by the USB thread when the device stops responding
+
+	std::atomic<uint64_t>	frames_produced;
+	std::atomic<uint64_t>	frames_delivered;
+	std::atomic<uint64_t>	frames_dropped;
+};
+
+} // namespace
+
+#endif
@@ -1,13 +1,18 @@
 // source code from https://github.com/inspirit/PS3EYEDriver
 #include "ps3eye.h"
+#include "ps3eye-debayer.h"
+#include "ps3eye-queue.h"
 
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <algorithm>
+#include <chrono>
 
 #if defined WIN32 || defined _WIN32 || defined WINCE
 	#include <windows.h>
+	#include <malloc.h>
 	#include <algorithm>
 
 	#ifdef __MINGW32__
@@ -54,6 +59,10 @@
 #else
 	#include <sys/time.h>
 	#include <time.h>
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <poll.h>
+	#include <unistd.h>
 	#if defined __MACH__ && defined __APPLE__
 		#include <mach/mach.h>
 		#include <mach/mach_time.h>
@@ -72,8 +81,8 @@
 
 namespace ps3eye {
 
-#define TRANSFER_SIZE		65536
-#define NUM_TRANSFERS		5
+#define MAX_TRANSFERS		64
+#define PAYLOAD_SIZE		2048	/* UVC payloads are packed back to back in a transfer */
 
 #define OV534_REG_ADDRESS	0xf1	/* sensor address */
 #define OV534_REG_SUBADDR	0xf2
@@ -90,6 +99,25 @@ namespace ps3eye {
 #define ARRAY_SIZE(_A) (sizeof(_A) / sizeof((_A)[0]))
 #endif
 
+// Host-side monotonic time in microseconds. Uses CLOCK_MONOTONIC where it exists so frame arrival times can be
+// compared against clock_gettime in the rest of the application.
+static uint64_t monotonic_time_us()
+{
+#if defined WIN32 || defined _WIN32 || defined WINCE
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// libusb 1.0.21 and later can map memory from usbfs that the host controller DMAs into directly. Define
+// PS3EYE_NO_DEV_MEM to leave it out of the build; PS3EYECam::setUseDeviceMemory turns it off at runtime.
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105) && !defined(PS3EYE_NO_DEV_MEM)
+	#define PS3EYE_HAVE_DEV_MEM
+#endif
+
 static const uint8_t ov534_reg_initdata[][2] = {
 	{ 0xe7, 0x3a },
 
@@ -293,6 +321,39 @@ static uint8_t find_ep(struct libusb_device *device)
 
 const uint16_t PS3EYECam::VENDOR_ID = 0x1415;
 const uint16_t PS3EYECam::PRODUCT_ID = 0x2000;
+const uint32_t PS3EYECam::DEFAULT_TRANSFER_COUNT = 5;
+const uint32_t PS3EYECam::DEFAULT_TRANSFER_SIZE = 65536;
+const uint32_t PS3EYECam::DEFAULT_STALL_INTERVALS = 10;
+
+// Hotplug notifications arrived in libusb 1.0.16. Without them, a camera that was unplugged is looked for again
+// every RECONNECT_INTERVAL_US instead of as soon as something is plugged in.
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+	#define PS3EYE_HAVE_HOTPLUG
+#endif
+
+#define RECONNECT_INTERVAL_US 1000000
+
+// The stall watchdog never fires sooner than this, whatever the frame rate, and gives a stream this long to deliver
+// its first frame after start
+#define MIN_STALL_TIMEOUT_US	200000
+#define STALL_GRACE_US			1000000
+
+// Everywhere but Windows, libusb exposes its file descriptors and the transfer thread sleeps in poll() on them until
+// there is actual USB activity, instead of waking up every 50ms to ask libusb.
+#if !(defined WIN32 || defined _WIN32 || defined WINCE)
+	#define PS3EYE_USB_REACTOR
+#endif
+
+// ov534_reg_write_batch pipelines its control transfers, which only works if the device sees them in the order they
+// were submitted. libusb doesn't promise that for asynchronous transfers on the default control endpoint. Linux does:
+// usbfs turns each one into an URB, and the URBs queued on one endpoint complete in order. Nothing documents it for the
+// macOS and Windows backends, so there the writes go one at a time. Define PS3EYE_NO_PIPELINED_CONTROL to do the same
+// on Linux, e.g. to time the difference with ps3eye-bench --setup.
+#if defined(__linux__) && !defined(PS3EYE_NO_PIPELINED_CONTROL)
+	#define PS3EYE_PIPELINED_CONTROL
+#endif
+
+class URBDesc;
 
 class USBMgr
 {
@@ -302,8 +363,15 @@ class USBMgr
 
 	static std::shared_ptr<USBMgr>  instance();
     int listDevices(std::vector<PS3EYECam::PS3EYERef>& list);
-	void cameraStarted();
-	void cameraStopped();
+	// urb, if given, is looked after by the stall watchdog until cameraStopped
+	void cameraStarted(URBDesc* urb = NULL);
+	void cameraStopped(URBDesc* urb = NULL);
+	libusb_context* getContext() const { return usb_context; }
+	// Incremented whenever a PS3 Eye is plugged in, if libusb can tell us
+	bool hasHotplug() const { return hotplug_registered; }
+	uint32_t getArrivalCount() const { return arrival_count.load(); }
+	// A PS3 Eye plugged into the same port as device (which may be device itself, if it is still there), referenced
+	libusb_device* findDeviceAtPort(libusb_device* device);
 
     static std::shared_ptr<USBMgr>  sInstance;
     static int                      sTotalDevices;
@@ -317,9 +385,40 @@ class USBMgr
     USBMgr(const USBMgr&);
     void operator=(const USBMgr&);
 
+	bool							hotplug_registered;
+	std::atomic<uint32_t>			arrival_count;
+#if defined(PS3EYE_HAVE_HOTPLUG)
+	libusb_hotplug_callback_handle	hotplug_handle;
+	static int LIBUSB_CALL hotplugArrived(libusb_context* ctx, libusb_device* device, libusb_hotplug_event event, void* user_data);
+#endif
+
+	std::mutex						watched_mutex;
+	std::vector<URBDesc*>			watched;			// Streaming cameras, for checkStalls
+
 	void startTransferThread();
 	void stopTransferThread();
 	void transferThreadFunc();
+	// Transfer thread only, with libusb's event lock held so that no transfer callback runs meanwhile. Runs the stall
+	// watchdog of every streaming camera and returns the earliest time, on the monotonic_time_us clock, at which it
+	// needs to run again (UINT64_MAX if never)
+	uint64_t checkStalls();
+	// Waits while another thread holds libusb's event lock, see runReactor
+	void waitForEventHandler();
+
+#if defined(PS3EYE_USB_REACTOR)
+	bool initReactor();
+	void runReactor();
+	bool pollEvents(std::vector<struct pollfd>& active);
+	void wakeTransferThread();
+	static void LIBUSB_CALL pollfdAdded(int fd, short events, void* user_data);
+	static void LIBUSB_CALL pollfdRemoved(int fd, void* user_data);
+
+	bool							reactor_enabled;	// libusb_get_pollfds is not supported by every backend
+	int								wake_pipe[2];		// Written to wake the transfer thread out of poll()
+	std::mutex						pollfds_mutex;
+	std::vector<struct pollfd>		pollfds;			// libusb's descriptors, kept up to date by the notifiers
+	std::atomic_bool				pollfds_changed;
+#endif
 };
 
 std::shared_ptr<USBMgr> USBMgr::sInstance;
@@ -331,11 +430,39 @@ USBMgr::USBMgr()
 	active_camera_count = 0;
     libusb_init(&usb_context);
     libusb_set_option(usb_context, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_ERROR);
+#if defined(PS3EYE_USB_REACTOR)
+	reactor_enabled = initReactor();
+	debug("USB event handling: %s\n", reactor_enabled ? "poll" : "timeout");
+#endif
+
+	// Removal shows up as failing transfers, which is quicker than the hotplug event, so only arrivals are of interest
+	hotplug_registered = false;
+	arrival_count = 0;
+#if defined(PS3EYE_HAVE_HOTPLUG)
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+	{
+		hotplug_registered = libusb_hotplug_register_callback(usb_context, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+															  PS3EYECam::VENDOR_ID, PS3EYECam::PRODUCT_ID, LIBUSB_HOTPLUG_MATCH_ANY,
+															  hotplugArrived, this, &hotplug_handle) == LIBUSB_SUCCESS;
+	}
+#endif
 }
 
 USBMgr::~USBMgr()
 {
     debug("USBMgr destructor\n");
+#if defined(PS3EYE_HAVE_HOTPLUG)
+	if (hotplug_registered)
+		libusb_hotplug_deregister_callback(usb_context, hotplug_handle);
+#endif
+#if defined(PS3EYE_USB_REACTOR)
+	if (reactor_enabled)
+	{
+		libusb_set_pollfd_notifiers(usb_context, NULL, NULL, NULL);
+		close(wake_pipe[0]);
+		close(wake_pipe[1]);
+	}
+#endif
     libusb_exit(usb_context);
 }
 
@@ -347,14 +474,34 @@ std::shared_ptr<USBMgr> USBMgr::instance()
     return sInstance;
 }
 
-void USBMgr::cameraStarted()
+#if defined(PS3EYE_HAVE_HOTPLUG)
+// Runs on the transfer thread, which keeps going while a camera waits to be reconnected. No I/O allowed in here.
+int LIBUSB_CALL USBMgr::hotplugArrived(libusb_context* ctx, libusb_device* device, libusb_hotplug_event event, void* user_data)
+{
+	USBMgr* mgr = reinterpret_cast<USBMgr*>(user_data);
+	mgr->arrival_count++;
+	return 0;
+}
+#endif
+
+void USBMgr::cameraStarted(URBDesc* urb)
 {
+	if (urb != NULL)
+	{
+		std::lock_guard<std::mutex> lock(watched_mutex);
+		watched.push_back(urb);
+	}
 	if (active_camera_count++ == 0)
 		startTransferThread();
 }
 
-void USBMgr::cameraStopped()
+void USBMgr::cameraStopped(URBDesc* urb)
 {
+	if (urb != NULL)
+	{
+		std::lock_guard<std::mutex> lock(watched_mutex);
+		watched.erase(std::remove(watched.begin(), watched.end(), urb), watched.end());
+	}
 	if (--active_camera_count == 0)
 		stopTransferThread();
 }
@@ -367,6 +514,9 @@ void USBMgr::startTransferThread()
 void USBMgr::stopTransferThread()
 {
 	exit_signaled = true;
+#if defined(PS3EYE_USB_REACTOR)
+	wakeTransferThread();
+#endif
 	update_thread.join();
 	// Reset the exit signal flag.
 	// If we don't and we call startTransferThread() again, transferThreadFunc will exit immediately.
@@ -377,16 +527,186 @@ void USBMgr::transferThreadFunc()
 {
 	SetThreadName("PS3EyeDriver Transfer Thread");
 
+#if defined(PS3EYE_USB_REACTOR)
+	if (reactor_enabled)
+	{
+		runReactor();
+		return;
+	}
+#endif
+
 	struct timeval tv;
 	tv.tv_sec = 0;
 	tv.tv_usec = 50 * 1000; // ms
 
 	while (!exit_signaled)
 	{
-		libusb_handle_events_timeout_completed(usb_context, &tv, NULL);
+		// Done by hand rather than with libusb_handle_events_timeout_completed so the watchdog runs under the event lock
+		if (libusb_try_lock_events(usb_context) == 0)
+		{
+			if (libusb_event_handling_ok(usb_context))
+			{
+				libusb_handle_events_locked(usb_context, &tv);
+				checkStalls();
+			}
+			libusb_unlock_events(usb_context);
+			continue;
+		}
+		waitForEventHandler();
 	}
 }
 
+// Someone else is handling events, ours included. Wait until it completes a transfer or lets go of the lock, looking
+// in on exit_signaled now and then. The watchdog waits too: callbacks are running on the other thread.
+void USBMgr::waitForEventHandler()
+{
+	struct timeval wait_tv = { 0, 50 * 1000 };
+	libusb_lock_event_waiters(usb_context);
+	if (libusb_event_handler_active(usb_context))
+		libusb_wait_for_event(usb_context, &wait_tv);
+	libusb_unlock_event_waiters(usb_context);
+}
+
+#if defined(PS3EYE_USB_REACTOR)
+bool USBMgr::initReactor()
+{
+	const struct libusb_pollfd** usb_pollfds = libusb_get_pollfds(usb_context);
+	if (usb_pollfds == NULL)
+		return false;
+
+	if (pipe(wake_pipe) != 0)
+	{
+		libusb_free_pollfds(usb_pollfds);
+		return false;
+	}
+	for (int index = 0; index < 2; ++index)
+	{
+		fcntl(wake_pipe[index], F_SETFL, fcntl(wake_pipe[index], F_GETFL) | O_NONBLOCK);
+		fcntl(wake_pipe[index], F_SETFD, FD_CLOEXEC);
+	}
+
+	for (int index = 0; usb_pollfds[index] != NULL; ++index)
+	{
+		struct pollfd entry = { usb_pollfds[index]->fd, usb_pollfds[index]->events, 0 };
+		pollfds.push_back(entry);
+	}
+	libusb_free_pollfds(usb_pollfds);
+
+	pollfds_changed = true;
+	libusb_set_pollfd_notifiers(usb_context, pollfdAdded, pollfdRemoved, this);
+	return true;
+}
+
+// libusb adds and removes descriptors as devices are opened and closed, possibly from other threads
+void LIBUSB_CALL USBMgr::pollfdAdded(int fd, short events, void* user_data)
+{
+	USBMgr* mgr = reinterpret_cast<USBMgr*>(user_data);
+	{
+		std::lock_guard<std::mutex> lock(mgr->pollfds_mutex);
+		struct pollfd entry = { fd, events, 0 };
+		mgr->pollfds.push_back(entry);
+		mgr->pollfds_changed = true;
+	}
+	mgr->wakeTransferThread();
+}
+
+void LIBUSB_CALL USBMgr::pollfdRemoved(int fd, void* user_data)
+{
+	USBMgr* mgr = reinterpret_cast<USBMgr*>(user_data);
+	{
+		std::lock_guard<std::mutex> lock(mgr->pollfds_mutex);
+		mgr->pollfds.erase(std::remove_if(mgr->pollfds.begin(), mgr->pollfds.end(),
+			[fd] (const struct pollfd& entry) { return entry.fd == fd; }), mgr->pollfds.end());
+		mgr->pollfds_changed = true;
+	}
+	mgr->wakeTransferThread();
+}
+
+void USBMgr::wakeTransferThread()
+{
+	const uint8_t token = 1;
+	// Nonblocking: if the pipe is full, the thread has plenty of wakeups pending already
+	ssize_t res = write(wake_pipe[1], &token, 1);
+	(void)res;
+}
+
+// Other threads handle events on the same context too: libusb's synchronous calls and ov534_reg_write_batch, on
+// whichever thread reconfigures a camera. So this follows libusb's event lock protocol ("Polling and timing" in its
+// docs): only the holder of the event lock polls libusb's descriptors, the others wait for it to complete their
+// transfers, and it steps aside when a thread closing a device needs the lock. Transfer callbacks run on whichever
+// thread holds the lock, so holding it is also what keeps the stall watchdog from racing them.
+void USBMgr::runReactor()
+{
+	// Descriptors being polled: a snapshot of pollfds, with the wake pipe in front
+	std::vector<struct pollfd> active;
+	pollfds_changed = true;
+
+	while (!exit_signaled)
+	{
+		if (libusb_try_lock_events(usb_context) == 0)
+		{
+			bool ok = true;
+			while (ok && !exit_signaled && libusb_event_handling_ok(usb_context))
+				ok = pollEvents(active);
+			libusb_unlock_events(usb_context);
+			if (!ok)
+				break;
+			continue;
+		}
+		waitForEventHandler();
+	}
+}
+
+// One round of the reactor, with the event lock held. Returns false if polling failed.
+bool USBMgr::pollEvents(std::vector<struct pollfd>& active)
+{
+	if (pollfds_changed.exchange(false))
+	{
+		std::lock_guard<std::mutex> lock(pollfds_mutex);
+		struct pollfd wake = { wake_pipe[0], POLLIN, 0 };
+		active.assign(1, wake);
+		active.insert(active.end(), pollfds.begin(), pollfds.end());
+	}
+
+	// Only needed on platforms where libusb can't fold its transfer timeouts into a descriptor
+	int timeout_ms = -1;
+	struct timeval next_timeout;
+	if (libusb_get_next_timeout(usb_context, &next_timeout) == 1)
+		timeout_ms = (int)(next_timeout.tv_sec * 1000 + (next_timeout.tv_usec + 999) / 1000);
+
+	// A healthy stream keeps poll() busy anyway; this only wakes us when one has gone quiet
+	uint64_t stall_check = checkStalls();
+	if (stall_check != UINT64_MAX)
+	{
+		uint64_t now = monotonic_time_us();
+		int stall_ms = stall_check > now ? (int)((stall_check - now + 999) / 1000) : 0;
+		if (timeout_ms < 0 || stall_ms < timeout_ms)
+			timeout_ms = stall_ms;
+	}
+
+	// libusb wakes us through one of its own descriptors when a thread closing a device wants the event lock
+	int res = poll(active.data(), (nfds_t)active.size(), timeout_ms);
+	if (res < 0 && errno != EINTR)
+	{
+		debug("USB poll error %d\n", errno);
+		return false;
+	}
+
+	if (active[0].revents & POLLIN)
+	{
+		uint8_t tokens[64];
+		while (read(wake_pipe[0], tokens, sizeof(tokens)) > 0)
+		{
+		}
+	}
+
+	// Descriptors are ready (or a timeout expired): let libusb process them without blocking again
+	struct timeval zero_tv = { 0, 0 };
+	libusb_handle_events_locked(usb_context, &zero_tv);
+	return true;
+}
+#endif
+
 int USBMgr::listDevices( std::vector<PS3EYECam::PS3EYERef>& list )
 {
 	libusb_device *dev;
@@ -424,304 +744,130 @@ int USBMgr::listDevices( std::vector<PS3EYECam::PS3EYERef>& list )
     return cnt;
 }
 
+libusb_device* USBMgr::findDeviceAtPort(libusb_device* device)
+{
+	uint8_t ports[7];
+	int port_count = libusb_get_port_numbers(device, ports, sizeof(ports));
+	uint8_t bus = libusb_get_bus_number(device);
+
+	libusb_device **devs;
+	if (libusb_get_device_list(usb_context, &devs) < 0)
+		return NULL;
+
+	libusb_device* found = NULL;
+	for (int index = 0; devs[index] != NULL && found == NULL; ++index)
+	{
+		struct libusb_device_descriptor desc;
+		libusb_get_device_descriptor(devs[index], &desc);
+		if (desc.idVendor != PS3EYECam::VENDOR_ID || desc.idProduct != PS3EYECam::PRODUCT_ID ||
+			libusb_get_bus_number(devs[index]) != bus)
+			continue;
+
+		uint8_t candidate_ports[7];
+		int candidate_count = libusb_get_port_numbers(devs[index], candidate_ports, sizeof(candidate_ports));
+		if (candidate_count == port_count && port_count > 0 && memcmp(candidate_ports, ports, port_count) == 0)
+			found = libusb_ref_device(devs[index]);
+	}
+
+	libusb_free_device_list(devs, 1);
+	return found;
+}
+
 static void LIBUSB_CALL transfer_completed_callback(struct libusb_transfer *xfr);
 
-class FrameQueue
+// Counters for the packet stream of one camera. Only transfer callbacks write them, one at a time under libusb's event
+// lock, so a relaxed load and store is enough
+// and keeps the lock prefix of fetch_add off the per-payload path; getStats may read them from any thread.
+class StreamCounters
 {
 public:
-	FrameQueue(uint32_t frame_size) :
-		frame_size			(frame_size),
-		num_frames			(2),
-		frame_buffer		((uint8_t*)malloc(frame_size * num_frames)),
-		head				(0),
-		tail				(0),
-		available			(0)
+	StreamCounters()
 	{
+		Reset();
 	}
 
-	~FrameQueue()
+	void Reset()
 	{
-		free(frame_buffer);
+		bytes.store(0);
+		payloads.store(0);
+		bad_headers.store(0);
+		payload_errors.store(0);
+		missing_pts.store(0);
+		oversize_frames.store(0);
+		short_frames.store(0);
+		frames.store(0);
+		incomplete_frames.store(0);
+		skipped_frames.store(0);
+		interval_min.store(UINT64_MAX);
+		interval_max.store(0);
+		interval_total.store(0);
+		interval_count.store(0);
+		last_frame_arrival = 0;
 	}
 
-	uint8_t* GetFrameBufferStart()
+	static void Add(std::atomic<uint64_t>& counter, uint64_t amount = 1)
 	{
-		return frame_buffer;
+		counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
 	}
 
-	uint8_t* Enqueue()
+	// Called for every completed frame with the arrival time of its first payload
+	void FrameCompleted(uint64_t arrival)
 	{
-		uint8_t* new_frame = NULL;
-
-		std::lock_guard<std::mutex> lock(mutex);
-
-		// Unlike traditional producer/consumer, we don't block the producer if the buffer is full (ie. the consumer is not reading data fast enough).
-		// Instead, if the buffer is full, we simply return the current frame pointer, causing the producer to overwrite the previous frame.
-		// This allows performance to degrade gracefully: if the consumer is not fast enough (< Camera FPS), it will miss frames, but if it is fast enough (>= Camera FPS), it will see everything.
-		//
-		// Note that because the the producer is writing directly to the ring buffer, we can only ever be a maximum of num_frames-1 ahead of the consumer, 
-		// otherwise the producer could overwrite the frame the consumer is currently reading (in case of a slow consumer)
-		if (available >= num_frames - 1)
+		Add(frames);
+		if (last_frame_arrival != 0)
 		{
-			return frame_buffer + head * frame_size;
+			uint64_t interval = arrival - last_frame_arrival;
+			if (interval < interval_min.load(std::memory_order_relaxed))
+				interval_min.store(interval, std::memory_order_relaxed);
+			if (interval > interval_max.load(std::memory_order_relaxed))
+				interval_max.store(interval, std::memory_order_relaxed);
+			Add(interval_total, interval);
+			Add(interval_count);
 		}
-
-		// Note: we don't need to copy any data to the buffer since the USB packets are directly written to the frame buffer.
-		// We just need to update head and available count to signal to the consumer that a new frame is available
-		head = (head + 1) % num_frames;
-		available++;
-
-		// Determine the next frame pointer that the producer should write to
-		new_frame = frame_buffer + head * frame_size;
-
-		// Signal consumer that data became available
-		empty_condition.notify_one();
-
-		return new_frame;
+		last_frame_arrival = arrival;
 	}
 
-	void Dequeue(uint8_t* new_frame, int frame_width, int frame_height, PS3EYECam::EOutputFormat outputFormat)
-	{		
-		std::unique_lock<std::mutex> lock(mutex);
-
-		// If there is no data in the buffer, wait until data becomes available
-		empty_condition.wait(lock, [this] () { return available != 0; });
-
-		// Copy from internal buffer
-		uint8_t* source = frame_buffer + frame_size * tail;
-
-		if (outputFormat == PS3EYECam::EOutputFormat::Bayer)
-		{
-			memcpy(new_frame, source, frame_size);
-		}
-		else if (outputFormat == PS3EYECam::EOutputFormat::BGR ||
-				 outputFormat == PS3EYECam::EOutputFormat::RGB)
-		{
-			DebayerRGB(frame_width, frame_height, source, new_frame, outputFormat == PS3EYECam::EOutputFormat::BGR);
-		}		
-		else if (outputFormat == PS3EYECam::EOutputFormat::Gray)
-		{
-			DebayerGray(frame_width, frame_height, source, new_frame);
-		}
-		// Update tail and available count
-		tail = (tail + 1) % num_frames;
-		available--;
-	}
-	
-	void DebayerGray(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer)
+	PS3EYECam::StreamStats Get() const
 	{
-		// PSMove output is in the following Bayer format (GRBG):
-		//
-		// G R G R G R
-		// B G B G B G
-		// G R G R G R
-		// B G B G B G
-		//
-		// This is the normal Bayer pattern shifted left one place.
-		
-		int				source_stride	= frame_width;
-		const uint8_t*	source_row		= inBayer;						// Start at first bayer pixel
-		int				dest_stride		= frame_width;
-		uint8_t*		dest_row		= outBuffer + dest_stride + 1; 	// We start outputting at the second pixel of the second row's G component
-		uint32_t R,G,B;
-		
-		// Fill rows 1 to height-1 of the destination buffer. First and last row are filled separately (they are copied from the second row and second-to-last rows respectively)
-		for (int y = 0; y < frame_height-1; source_row += source_stride, dest_row += dest_stride, ++y)
+		PS3EYECam::StreamStats stats;
+		stats.bytes				= bytes.load(std::memory_order_relaxed);
+		stats.payloads			= payloads.load(std::memory_order_relaxed);
+		stats.badHeaders		= bad_headers.load(std::memory_order_relaxed);
+		stats.payloadErrors		= payload_errors.load(std::memory_order_relaxed);
+		stats.missingPts		= missing_pts.load(std::memory_order_relaxed);
+		stats.oversizeFrames	= oversize_frames.load(std::memory_order_relaxed);
+		stats.shortFrames		= short_frames.load(std::memory_order_relaxed);
+		stats.frames			= frames.load(std::memory_order_relaxed);
+		stats.incompleteFrames	= incomplete_frames.load(std::memory_order_relaxed);
+		stats.skippedFrames		= skipped_frames.load(std::memory_order_relaxed);
+
+		uint64_t count = interval_count.load(std::memory_order_relaxed);
+		if (count > 0)
 		{
-			const uint8_t* source		= source_row;
-			const uint8_t* source_end	= source + (source_stride-2);								// -2 to deal with the fact that we're starting at the second pixel of the row and should end at the second-to-last pixel of the row (first and last are filled separately)
-			uint8_t* dest				= dest_row;
-			
-			// Row starting with Green
-			if (y % 2 == 0)
-			{
-				// Fill first pixel (green)
-				B = (source[source_stride] + source[source_stride + 2] + 1) >> 1;
-				G = source[source_stride + 1];
-				R = (source[1] + source[source_stride * 2 + 1] + 1) >> 1;
-				*dest = (uint8_t)((R*77 + G*151 + B*28)>>8);
-				
-				source++;
-				dest++;
-				
-				// Fill remaining pixel
-				for (; source <= source_end - 2; source += 2, dest += 2)
-				{
-					// Blue pixel
-					B = source[source_stride + 1];
-					G = (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;
-					R = (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;
-					dest[0] = (uint8_t)((R*77 + G*151 + B*28)>>8);
-
-					//  Green pixel
-					B = (source[source_stride + 1] + source[source_stride + 3] + 1) >> 1;
-					G = source[source_stride + 2];
-					R = (source[2] + source[source_stride * 2 + 2] + 1) >> 1;
-					dest[1] = (uint8_t)((R*77 + G*151 + B*28)>>8);
-
-				}
-			}
-			else
-			{
-				for (; source <= source_end - 2; source += 2, dest += 2)
-				{
-					// Red pixel
-					B = (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;;
-					G = (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;;
-					R = source[source_stride + 1];
-					dest[0] = (uint8_t)((R*77 + G*151 + B*28)>>8);
-
-					// Green pixel
-					B = (source[2] + source[source_stride * 2 + 2] + 1) >> 1;
-					G = source[source_stride + 2];
-					R = (source[source_stride + 1] + source[source_stride + 3] + 1) >> 1;
-					dest[1] = (uint8_t)((R*77 + G*151 + B*28)>>8);
-				}
-			}
-			
-			if (source < source_end)
-			{
-				B = source[source_stride + 1];
-				G = (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;
-				R = (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;;
-				dest[0] = (uint8_t)((R*77 + G*151 + B*28)>>8);
-
-				source++;
-				dest++;
-			}
-			
-			// Fill first pixel of row (copy second pixel)
-			uint8_t* first_pixel	= dest_row-1;
-			first_pixel[0]			= dest_row[0];
-			
-			// Fill last pixel of row (copy second-to-last pixel). Note: dest row starts at the *second* pixel of the row, so dest_row + (width-2) * num_output_channels puts us at the last pixel of the row
-			uint8_t* last_pixel				= dest_row + (frame_width - 2);
-			uint8_t* second_to_last_pixel	= last_pixel - 1;
-			last_pixel[0]					= second_to_last_pixel[0];
-		}
-		
-		// Fill first & last row
-		for (int i = 0; i < dest_stride; i++)
-		{
-			outBuffer[i]									= outBuffer[i + dest_stride];
-			outBuffer[i + (frame_height - 1)*dest_stride]	= outBuffer[i + (frame_height - 2)*dest_stride];
+			stats.minFrameInterval	= interval_min.load(std::memory_order_relaxed);
+			stats.maxFrameInterval	= interval_max.load(std::memory_order_relaxed);
+			stats.avgFrameInterval	= interval_total.load(std::memory_order_relaxed) / count;
 		}
+		return stats;
 	}
 
-	void DebayerRGB(int frame_width, int frame_height, const uint8_t* inBayer, uint8_t* outBuffer, bool inBGR)
-	{
-		// PSMove output is in the following Bayer format (GRBG):
-		//
-		// G R G R G R
-		// B G B G B G
-		// G R G R G R
-		// B G B G B G
-		//
-		// This is the normal Bayer pattern shifted left one place.
-
-		int				num_output_channels	    = 3;
-		int				source_stride			= frame_width;
-		const uint8_t*	source_row				= inBayer;												// Start at first bayer pixel
-		int				dest_stride				= frame_width * num_output_channels;
-		uint8_t*		dest_row				= outBuffer + dest_stride + num_output_channels + 1; 	// We start outputting at the second pixel of the second row's G component
-		int				swap_br					= inBGR ? 1 : -1;
-
-		// Fill rows 1 to height-1 of the destination buffer. First and last row are filled separately (they are copied from the second row and second-to-last rows respectively)
-		for (int y = 0; y < frame_height-1; source_row += source_stride, dest_row += dest_stride, ++y)
-		{
-			const uint8_t* source		= source_row;
-			const uint8_t* source_end	= source + (source_stride-2);								// -2 to deal with the fact that we're starting at the second pixel of the row and should end at the second-to-last pixel of the row (first and last are filled separately)
-			uint8_t* dest				= dest_row;		
-
-			// Row starting with Green
-			if (y % 2 == 0)
-			{
-				// Fill first pixel (green)
-				dest[-1*swap_br]	= (source[source_stride] + source[source_stride + 2] + 1) >> 1;
-				dest[0]				= source[source_stride + 1];
-				dest[1*swap_br]		= (source[1] + source[source_stride * 2 + 1] + 1) >> 1;		
-
-				source++;
-				dest += num_output_channels;
-
-				// Fill remaining pixel
-				for (; source <= source_end - 2; source += 2, dest += num_output_channels * 2)
-				{
-					// Blue pixel
-					uint8_t* cur_pixel	= dest;
-					cur_pixel[-1*swap_br]	= source[source_stride + 1];
-					cur_pixel[0]			= (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;
-					cur_pixel[1*swap_br]	= (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;				
-
-					//  Green pixel
-					uint8_t* next_pixel		= cur_pixel+num_output_channels;
-					next_pixel[-1*swap_br]	= (source[source_stride + 1] + source[source_stride + 3] + 1) >> 1;					
-					next_pixel[0]			= source[source_stride + 2];
-					next_pixel[1*swap_br]	= (source[2] + source[source_stride * 2 + 2] + 1) >> 1;
-				}
-			}
-			else
-			{
-				for (; source <= source_end - 2; source += 2, dest += num_output_channels * 2)
-				{
-					// Red pixel
-					uint8_t* cur_pixel	= dest;
-					cur_pixel[-1*swap_br]	= (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;;
-					cur_pixel[0]			= (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;;
-					cur_pixel[1*swap_br]	= source[source_stride + 1];
-
-					// Green pixel
-					uint8_t* next_pixel		= cur_pixel+num_output_channels;
-					next_pixel[-1*swap_br]	= (source[2] + source[source_stride * 2 + 2] + 1) >> 1;
-					next_pixel[0]			= source[source_stride + 2];
-					next_pixel[1*swap_br]	= (source[source_stride + 1] + source[source_stride + 3] + 1) >> 1;
-				}
-			}
-
-			if (source < source_end)
-			{
-				dest[-1*swap_br]	= source[source_stride + 1];
-				dest[0]				= (source[1] + source[source_stride] + source[source_stride + 2] + source[source_stride * 2 + 1] + 2) >> 2;			
-				dest[1*swap_br]		= (source[0] + source[2] + source[source_stride * 2] + source[source_stride * 2 + 2] + 2) >> 2;;			
-
-				source++;
-				dest += num_output_channels;
-			}
-
-			// Fill first pixel of row (copy second pixel)
-			uint8_t* first_pixel		= dest_row-num_output_channels;
-			first_pixel[-1*swap_br]		= dest_row[-1*swap_br];
-			first_pixel[0]				= dest_row[0];
-			first_pixel[1*swap_br]		= dest_row[1*swap_br];
-		
- 			// Fill last pixel of row (copy second-to-last pixel). Note: dest row starts at the *second* pixel of the row, so dest_row + (width-2) * num_output_channels puts us at the last pixel of the row
-			uint8_t* last_pixel				= dest_row + (frame_width - 2)*num_output_channels;
-			uint8_t* second_to_last_pixel	= last_pixel - num_output_channels;
-			
-			last_pixel[-1*swap_br]			= second_to_last_pixel[-1*swap_br];
-			last_pixel[0]					= second_to_last_pixel[0];
-			last_pixel[1*swap_br]			= second_to_last_pixel[1*swap_br];
-		}
-
-		// Fill first & last row
-		for (int i = 0; i < dest_stride; i++)
-		{
-			outBuffer[i]									= outBuffer[i + dest_stride];
-			outBuffer[i + (frame_height - 1)*dest_stride]	= outBuffer[i + (frame_height - 2)*dest_stride];
-		}
-	}
+	std::atomic<uint64_t>	bytes;
+	std::atomic<uint64_t>	payloads;
+	std::atomic<uint64_t>	bad_headers;
+	std::atomic<uint64_t>	payload_errors;
+	std::atomic<uint64_t>	missing_pts;
+	std::atomic<uint64_t>	oversize_frames;
+	std::atomic<uint64_t>	short_frames;
+	std::atomic<uint64_t>	frames;
+	std::atomic<uint64_t>	incomplete_frames;
+	std::atomic<uint64_t>	skipped_frames;
 
 private:
-	uint32_t				frame_size;
-	uint32_t				num_frames;
-
-	uint8_t*				frame_buffer;
-	uint32_t				head;
-	uint32_t				tail;
-	uint32_t				available;
-
-	std::mutex				mutex;
-	std::condition_variable	empty_condition;
+	std::atomic<uint64_t>	interval_min;
+	std::atomic<uint64_t>	interval_max;
+	std::atomic<uint64_t>	interval_total;
+	std::atomic<uint64_t>	interval_count;
+	uint64_t				last_frame_arrival;		// Callbacks only
 };
 
 // URBDesc
@@ -731,14 +877,28 @@ class URBDesc
 public:
 	URBDesc() : 
 		num_active_transfers			(0),
+		closing					(false),
 		last_packet_type		(DISCARD_PACKET), 
 		last_pts				(0), 
 		last_fid				(0), 
+		skipping_frame			(false),
+		decimation_interval		(1),
+		skip_when_busy			(false),
+		decimation_counter		(0),
+		transfer_handle			(NULL),
 		transfer_buffer			(NULL),
+		transfer_buffer_size	(0),
+		transfer_buffer_mapped	(false),
 		cur_frame_start			(NULL),
 		cur_frame_data_len		(0),
+		frame_width				(0),
+		frame_height			(0),
 		frame_size				(0),
-		frame_queue				(NULL)
+		pending_frame_format	(0),
+		device_lost				(false),
+		stalled					(false),
+		stall_timeout			(0),
+		last_progress			(0)
 	{
 	}
 
@@ -748,75 +908,290 @@ public:
 		close_transfers();
 	}
 
-	bool start_transfers(libusb_device_handle *handle, uint32_t curr_frame_size)
+	bool start_transfers(libusb_device_handle *handle, uint32_t width, uint32_t height, uint32_t frame_capacity, uint32_t queue_depth,
+						 PS3EYECam::EDropPolicy drop_policy, uint32_t num_transfers, uint32_t transfer_size, bool use_device_memory)
 	{
 		// Initialize the frame queue
-        frame_size = curr_frame_size;
-		frame_queue = new FrameQueue(frame_size);
+		set_frame_size(width, height);
+		apply_frame_size();
+		std::shared_ptr<FrameQueue> queue = std::make_shared<FrameQueue>((std::max)(frame_size, frame_capacity), queue_depth, drop_policy);
+		queue->SetFreeCallback([this] () { resume_transfers(); });
+		{
+			std::lock_guard<std::mutex> lock(frame_queue_mutex);
+			frame_queue = queue;
+		}
 
-		// Initialize the current frame pointer to the start of the buffer; it will be updated as frames are completed and pushed onto the frame queue
+		// Reset everything the callbacks keep per stream before the first submit, since a transfer's callback can run
+		// as soon as it is submitted. The current frame pointer starts at the first buffer and moves on as frames are
+		// completed and pushed onto the frame queue.
 		cur_frame_start = frame_queue->GetFrameBufferStart();
 		cur_frame_data_len = 0;
+		last_packet_type = DISCARD_PACKET;
+		last_pts = 0;
+		last_fid = 0;
+		skipping_frame = false;
+		decimation_counter = 0;
+		stats.Reset();
+		device_lost = false;
+		stalled = false;
+		last_progress = monotonic_time_us() + STALL_GRACE_US;
 
 		// Find the bulk transfer endpoint
 		uint8_t bulk_endpoint = find_ep(libusb_get_device(handle));
 		libusb_clear_halt(handle, bulk_endpoint);
 
-		// Allocate the transfer buffer
-		transfer_buffer = (uint8_t*)malloc(TRANSFER_SIZE * NUM_TRANSFERS);
-		memset(transfer_buffer, 0, TRANSFER_SIZE * NUM_TRANSFERS);
+		// Allocate the transfer buffer. Device memory saves the kernel copying every payload from a bounce buffer into
+		// ours; when it's not available (older libusb, non-Linux, usbfs without mmap) fall back to page-aligned memory.
+		transfer_handle = handle;
+		transfer_buffer_size = transfer_size * num_transfers;
+		transfer_buffer = NULL;
+#if defined(PS3EYE_HAVE_DEV_MEM)
+		if (use_device_memory)
+			transfer_buffer = libusb_dev_mem_alloc(handle, transfer_buffer_size);
+#endif
+		transfer_buffer_mapped = transfer_buffer != NULL;
+		if (!transfer_buffer_mapped)
+		{
+			transfer_buffer = (uint8_t*)aligned_malloc(transfer_buffer_size, BUFFER_ALIGNMENT);
+			memset(transfer_buffer, 0, transfer_buffer_size);
+		}
+		debug("Transfer buffers in %s memory\n", transfer_buffer_mapped ? "device" : "host");
+
+		{
+			std::lock_guard<std::mutex> lock(num_active_transfers_mutex);
+			closing = false;
+			parked.clear();
+		}
 
 		int res = 0;
-		for (int index = 0; index < NUM_TRANSFERS; ++index)
+		xfr.resize(num_transfers);
+		for (uint32_t index = 0; index < num_transfers; ++index)
 		{
 			// Create & submit the transfer
 			xfr[index] = libusb_alloc_transfer(0);
-			libusb_fill_bulk_transfer(xfr[index], handle, bulk_endpoint, transfer_buffer + index * TRANSFER_SIZE, TRANSFER_SIZE, transfer_completed_callback, reinterpret_cast<void*>(this), 0);
+			libusb_fill_bulk_transfer(xfr[index], handle, bulk_endpoint, transfer_buffer + index * transfer_size, transfer_size, transfer_completed_callback, reinterpret_cast<void*>(this), 0);
 
-			res |= libusb_submit_transfer(xfr[index]);
-			
+			// Counted first: on a camera that is going away, the callback can run before submit returns
+			std::lock_guard<std::mutex> lock(num_active_transfers_mutex);
 			num_active_transfers++;
+			int submit_res = libusb_submit_transfer(xfr[index]);
+			res |= submit_res;
+			if (submit_res != 0)
+			{
+				libusb_free_transfer(xfr[index]);
+				xfr[index] = NULL;
+				num_active_transfers--;
+			}
 		}
 
-		last_pts = 0;
-		last_fid = 0;
-
-		USBMgr::instance()->cameraStarted();
+		USBMgr::instance()->cameraStarted(this);
 
 		return res == 0;
 	}
 
+	// Not called from the USB thread: this waits for it to retire the transfers
 	void close_transfers()
 	{
 		std::unique_lock<std::mutex> lock(num_active_transfers_mutex);
-		if (num_active_transfers == 0)
+		if (!frame_queue)
 			return;
 
-		// Cancel any pending transfers
-		for (int index = 0; index < NUM_TRANSFERS; ++index)
+		// No more resubmits from the consumer. Cleared without our lock, which resume_transfers takes inside the queue's.
+		lock.unlock();
+		frame_queue->SetFreeCallback(nullptr);
+		lock.lock();
+
+		// Nothing calls back for the transfers parked by resubmit, and completed ones must not be resubmitted or parked
+		closing = true;
+		for (size_t index = 0; index < parked.size(); ++index)
+		{
+			std::replace(xfr.begin(), xfr.end(), parked[index], (libusb_transfer*)NULL);
+			libusb_free_transfer(parked[index]);
+			--num_active_transfers;
+		}
+		parked.clear();
+
+		// Cancel any pending transfers (the ones that failed are gone already)
+		for (size_t index = 0; index < xfr.size(); ++index)
 		{
-			libusb_cancel_transfer(xfr[index]);
+			if (xfr[index] != NULL)
+				libusb_cancel_transfer(xfr[index]);
 		}
 
 		// Wait for cancelation to finish
 		num_active_transfers_condition.wait(lock, [this]() { return num_active_transfers == 0; });
 
-		USBMgr::instance()->cameraStopped();
+		// The watchdog takes the USBMgr lock before ours
+		lock.unlock();
+		USBMgr::instance()->cameraStopped(this);
 
-		free(transfer_buffer);
+#if defined(PS3EYE_HAVE_DEV_MEM)
+		if (transfer_buffer_mapped)
+			libusb_dev_mem_free(transfer_handle, transfer_buffer, transfer_buffer_size);
+		else
+#endif
+			aligned_free(transfer_buffer);
 		transfer_buffer = NULL;
 
-		delete frame_queue;
-		frame_queue = NULL;
+		// Wake a consumer waiting for a frame. It and any lease still out keep the queue alive as long as they need it.
+		std::shared_ptr<FrameQueue> queue;
+		{
+			std::lock_guard<std::mutex> queue_lock(frame_queue_mutex);
+			queue.swap(frame_queue);
+		}
+		queue->Disconnect();
+	}
+
+	// The consumer's reference to the frame queue, empty when not streaming. Taken under the lock since start_transfers
+	// and close_transfers may replace it meanwhile; the callbacks use frame_queue directly, they only run in between.
+	std::shared_ptr<FrameQueue> get_frame_queue()
+	{
+		std::lock_guard<std::mutex> lock(frame_queue_mutex);
+		return frame_queue;
+	}
+
+	// Size of the frames the camera sends from now on. Picked up by the callback when the next frame starts, so the
+	// frame in progress is discarded by the size checks rather than queued with the wrong size. Must fit the frame queue.
+	void set_frame_size(uint32_t width, uint32_t height)
+	{
+		pending_frame_format.store((width << 16) | height, std::memory_order_release);
+	}
+
+	uint32_t get_frame_capacity() const
+	{
+		return frame_queue->GetFrameCapacity();
+	}
+
+	void apply_frame_size()
+	{
+		uint32_t format = pending_frame_format.load(std::memory_order_acquire);
+		frame_width = format >> 16;
+		frame_height = format & 0xffff;
+		frame_size = frame_width * frame_height;
 	}
 
-	void transfer_canceled()
+	// Frees a transfer that is no longer submitted. Under the lock, so close_transfers and transfer_failed never cancel
+	// a freed one.
+	void transfer_canceled(libusb_transfer* transfer)
 	{
 		std::lock_guard<std::mutex> lock(num_active_transfers_mutex);
+		std::replace(xfr.begin(), xfr.end(), transfer, (libusb_transfer*)NULL);
+		libusb_free_transfer(transfer);
 		--num_active_transfers;
 		num_active_transfers_condition.notify_one();
 	}
 
+	// Puts a transfer back in flight once its data has been scanned. Under BlockProducer, a transfer that completes
+	// while the frame queue has no buffer to write into is parked instead, so the camera stops sending until the
+	// consumer frees one (see resume_transfers). From the transfer callback, with libusb's event lock held.
+	void resubmit(libusb_transfer* transfer)
+	{
+		std::unique_lock<std::mutex> lock(num_active_transfers_mutex);
+		if (closing)
+		{
+			lock.unlock();
+			transfer_canceled(transfer);
+			return;
+		}
+
+		// Checked under the lock: a buffer freed after this is followed by resume_transfers, which sees the transfer
+		if (cur_frame_start == NULL && !frame_queue->HasFreeFrame())
+		{
+			parked.push_back(transfer);
+			return;
+		}
+
+		if (libusb_submit_transfer(transfer) < 0)
+		{
+			debug("error re-submitting URB\n");
+			lock.unlock();
+			transfer_failed();
+			transfer_canceled(transfer);
+		}
+	}
+
+	// Called by the frame queue on the consumer's thread when it frees a buffer: resubmits the transfers parked by
+	// resubmit, the callback picks the buffer up when the next frame starts
+	void resume_transfers()
+	{
+		std::vector<libusb_transfer*> failed;
+		{
+			std::lock_guard<std::mutex> lock(num_active_transfers_mutex);
+			if (closing)
+				return;
+			for (size_t index = 0; index < parked.size(); ++index)
+			{
+				if (libusb_submit_transfer(parked[index]) < 0)
+					failed.push_back(parked[index]);
+			}
+			parked.clear();
+		}
+
+		for (size_t index = 0; index < failed.size(); ++index)
+		{
+			debug("error re-submitting URB\n");
+			transfer_failed();
+			transfer_canceled(failed[index]);
+		}
+	}
+
+	// A transfer failed for another reason than being canceled, typically because the camera was unplugged. The rest
+	// of them are retired too and the consumer is told; PS3EYECam takes it from there.
+	void transfer_failed()
+	{
+		if (device_lost.exchange(true))
+			return;
+		debug("device lost\n");
+
+		std::lock_guard<std::mutex> lock(num_active_transfers_mutex);
+		for (size_t index = 0; index < xfr.size(); ++index)
+		{
+			if (xfr[index] != NULL)
+				libusb_cancel_transfer(xfr[index]);
+		}
+		frame_queue->Disconnect();
+	}
+
+	bool is_device_lost() const
+	{
+		return device_lost.load();
+	}
+
+	// The stream was given up on by the watchdog rather than because the device went away
+	bool is_stalled() const
+	{
+		return stalled.load();
+	}
+
+	// 0 disables the watchdog
+	void set_stall_timeout(uint64_t timeout_us)
+	{
+		stall_timeout.store(timeout_us);
+	}
+
+	// From USBMgr::checkStalls, with libusb's event lock held so no callback of this stream runs meanwhile. Declares the
+	// stream lost, like a failed transfer, if no frame has made it through for longer than the stall timeout. Returns
+	// when to check again.
+	uint64_t check_stall(uint64_t now)
+	{
+		uint64_t timeout = stall_timeout.load();
+		if (timeout == 0 || device_lost.load())
+			return UINT64_MAX;
+
+		// Not stalled, waiting for the consumer to free a buffer under BlockProducer
+		if (cur_frame_start == NULL)
+			last_progress = now;
+
+		uint64_t deadline = last_progress + timeout;
+		if (now < deadline)
+			return deadline;
+
+		debug("stream stalled\n");
+		stalled = true;
+		transfer_failed();
+		return UINT64_MAX;
+	}
+
 	void frame_add(enum gspca_packet_type packet_type, const uint8_t *data, int len)
 	{
 	    if (packet_type == FIRST_PACKET) 
@@ -845,6 +1220,7 @@ public:
         {
             if(cur_frame_data_len + len > frame_size)
             {
+                StreamCounters::Add(stats.oversize_frames);
                 packet_type = DISCARD_PACKET;
                 cur_frame_data_len = 0;
             } else {
@@ -857,11 +1233,29 @@ public:
 
 	    if (packet_type == LAST_PACKET) {        
 			cur_frame_data_len = 0;
-			cur_frame_start = frame_queue->Enqueue();
+			stats.FrameCompleted(cur_frame_info.arrival);
+			cur_frame_start = frame_queue->Enqueue(cur_frame_info);
+			last_progress = monotonic_time_us();
 	        //debug("frame completed %d\n", frame_complete_ind);
 	    }
 	}
 
+	// Decides, when a frame starts, whether it gets copied into the frame queue at all
+	bool skip_frame()
+	{
+		// Under BlockProducer the queue may have run out of buffers. Skipped until the consumer has freed one.
+		if (cur_frame_start == NULL && (cur_frame_start = frame_queue->ResumeWriting()) == NULL)
+			return true;
+
+		uint32_t interval = decimation_interval.load(std::memory_order_relaxed);
+		if (interval > 1 && (decimation_counter++ % interval) != 0)
+			return true;
+
+		// The consumer still holds every other buffer: the drop policy would throw this frame (or an older one) away
+		// anyway, so leave the queue as it is and don't pay for the copy
+		return skip_when_busy.load(std::memory_order_relaxed) && !frame_queue->HasFreeFrame();
+	}
+
 	void pkt_scan(uint8_t *data, int len)
 	{
 	    uint32_t this_pts;
@@ -869,9 +1263,11 @@ public:
 	    int remaining_len = len;
 	    int payload_len;
 
-	    payload_len = 2048; // bulk type
+	    payload_len = PAYLOAD_SIZE; // bulk type
+	    StreamCounters::Add(stats.bytes, len);
 	    do {
 			len = (std::min)(remaining_len, payload_len);
+			StreamCounters::Add(stats.payloads);
 
 	        /* Payloads are prefixed with a UVC-style header.  We
 	           consider a frame to start when the FID toggles, or the PTS
@@ -881,18 +1277,21 @@ public:
 	        /* Verify UVC header.  Header length is always 12 */
 	        if (data[0] != 12 || len < 12) {
 	            debug("bad header\n");
+	            StreamCounters::Add(stats.bad_headers);
 	            goto discard;
 	        }
 
 	        /* Check errors */
 	        if (data[1] & UVC_STREAM_ERR) {
 	            debug("payload error\n");
+	            StreamCounters::Add(stats.payload_errors);
 	            goto discard;
 	        }
 
 	        /* Extract PTS and FID */
 	        if (!(data[1] & UVC_STREAM_PTS)) {
 	            debug("PTS not present\n");
+	            StreamCounters::Add(stats.missing_pts);
 	            goto discard;
 	        }
 
@@ -904,17 +1303,43 @@ public:
 	            if (last_packet_type == INTER_PACKET)
 	            {
 	                /* The last frame was incomplete, so don't keep it or we will glitch */
+	                StreamCounters::Add(stats.incomplete_frames);
 	                frame_add(DISCARD_PACKET, NULL, 0);
 	            }
+	            else if (last_packet_type == FIRST_PACKET)
+	            {
+	                /* Same, but the new frame simply starts over in the same buffer */
+	                StreamCounters::Add(stats.incomplete_frames);
+	            }
 	            last_pts = this_pts;
 	            last_fid = this_fid;
+	            apply_frame_size();
+	            skipping_frame = skip_frame();
+	            if (skipping_frame)
+	            {
+	                /* Nobody will read this one, don't copy any of it */
+	                StreamCounters::Add(stats.skipped_frames);
+	                goto discard;
+	            }
+	            cur_frame_info.pts = this_pts;
+	            cur_frame_info.arrival = monotonic_time_us();
+	            cur_frame_info.width = frame_width;
+	            cur_frame_info.height = frame_height;
 	            frame_add(FIRST_PACKET, data + 12, len - 12);
 	        } /* If this packet is marked as EOF, end the frame */
 	        else if (data[1] & UVC_STREAM_EOF) 
 	        {
 	            last_pts = 0;
+	            if (skipping_frame)
+	            {
+	                /* Skipped on purpose, it still shows the stream is alive */
+	                skipping_frame = false;
+	                last_progress = monotonic_time_us();
+	                goto discard;
+	            }
                 if(cur_frame_data_len + len - 12 != frame_size)
                 {
+                    StreamCounters::Add(stats.short_frames);
                     goto discard;
                 }
 	            frame_add(LAST_PACKET, data + 12, len - 12);
@@ -939,17 +1364,37 @@ public:
 	uint8_t					num_active_transfers;
 	std::mutex				num_active_transfers_mutex;
 	std::condition_variable	num_active_transfers_condition;
+	bool					closing;			// Under num_active_transfers_mutex, like parked
+	std::vector<libusb_transfer*> parked;		// Completed transfers held back by resubmit
 
 	enum gspca_packet_type	last_packet_type;
 	uint32_t				last_pts;
 	uint16_t				last_fid;
-	libusb_transfer*		xfr[NUM_TRANSFERS];
+	bool					skipping_frame;		// The current frame is being discarded by skip_frame
+
+	std::atomic<uint32_t>	decimation_interval;	// Set by the consumer, see PS3EYECam::setDecimation
+	std::atomic_bool		skip_when_busy;
+	uint32_t				decimation_counter;
+	std::vector<libusb_transfer*> xfr;
 
+	libusb_device_handle*	transfer_handle;
 	uint8_t*				transfer_buffer;
+	size_t					transfer_buffer_size;
+	bool					transfer_buffer_mapped;		// From libusb_dev_mem_alloc
     uint8_t*				cur_frame_start;
 	uint32_t				cur_frame_data_len;
+	PS3EYECam::FrameInfo	cur_frame_info;
+	uint32_t				frame_width;		// Size of the current frame, under libusb's event lock like the rest of the stream state
+	uint32_t				frame_height;
 	uint32_t				frame_size;
-	FrameQueue*				frame_queue;
+	std::atomic<uint32_t>	pending_frame_format;	// width << 16 | height, see set_frame_size
+	std::shared_ptr<FrameQueue> frame_queue;	// Shared with leases and a consumer waiting in getFrame, see get_frame_queue
+	std::mutex				frame_queue_mutex;
+	StreamCounters			stats;
+	std::atomic_bool		device_lost;		// A transfer failed, see transfer_failed
+	std::atomic_bool		stalled;			// ... or the watchdog gave up, see check_stall
+	std::atomic<uint64_t>	stall_timeout;		// Microseconds, set by PS3EYECam::update_stall_timeout
+	uint64_t				last_progress;		// When the last frame was completed, under libusb's event lock
 };
 
 static void LIBUSB_CALL transfer_completed_callback(struct libusb_transfer *xfr)
@@ -961,24 +1406,30 @@ static void LIBUSB_CALL transfer_completed_callback(struct libusb_transfer *xfr)
     {
         debug("transfer status %d\n", status);
 
-        libusb_free_transfer(xfr);
-		urb->transfer_canceled();
-        
         if(status != LIBUSB_TRANSFER_CANCELLED)
         {
-            urb->close_transfers();
+            urb->transfer_failed();
         }
+
+		urb->transfer_canceled(xfr);
         return;
     }
 
     //debug("length:%u, actual_length:%u\n", xfr->length, xfr->actual_length);
 
     urb->pkt_scan(xfr->buffer, xfr->actual_length);
+    urb->resubmit(xfr);
+}
 
-    if (libusb_submit_transfer(xfr) < 0) {
-        debug("error re-submitting URB\n");
-        urb->close_transfers();
-    }
+uint64_t USBMgr::checkStalls()
+{
+	uint64_t now = monotonic_time_us();
+	uint64_t next_check = UINT64_MAX;
+
+	std::lock_guard<std::mutex> lock(watched_mutex);
+	for (size_t index = 0; index < watched.size(); ++index)
+		next_check = (std::min)(next_check, watched[index]->check_stall(now));
+	return next_check;
 }
 
 // PS3EYECam
@@ -1018,8 +1469,28 @@ PS3EYECam::PS3EYECam(libusb_device *device)
 
 	usb_buf = NULL;
 	handle_ = NULL;
+	invalidate_shadows();
+
+	frame_width = 0;
+	frame_height = 0;
+	sensor_width = 0;
+	sensor_height = 0;
+	window_x = 0;
+	window_y = 0;
+	frame_queue_depth = 2;
+	frame_drop_policy = EDropPolicy::DropNewest;
+	transfer_count = DEFAULT_TRANSFER_COUNT;
+	transfer_size = DEFAULT_TRANSFER_SIZE;
+	use_device_memory = true;
 
 	is_streaming = false;
+	stream_lost = false;
+	reconnect_arrivals = 0;
+	reconnect_time = 0;
+	reconnect_missing = false;
+	reconnect_count = 0;
+	stall_intervals = DEFAULT_STALL_INTERVALS;
+	stall_recovery_count = 0;
 
 	device_ = device;
 	mgrPtr = USBMgr::instance();
@@ -1039,7 +1510,8 @@ void PS3EYECam::release()
 	if(usb_buf) free(usb_buf);
 }
 
-bool PS3EYECam::init(uint32_t width, uint32_t height, uint16_t desiredFrameRate, EOutputFormat outputFormat)
+bool PS3EYECam::init(uint32_t width, uint32_t height, uint16_t desiredFrameRate, EOutputFormat outputFormat, uint32_t queueDepth, EDropPolicy dropPolicy,
+					 uint32_t transferCount, uint32_t transferSize)
 {
 	uint16_t sensor_id;
 
@@ -1056,17 +1528,14 @@ bool PS3EYECam::init(uint32_t width, uint32_t height, uint16_t desiredFrameRate,
 	if(usb_buf == NULL)
 		usb_buf = (uint8_t*)malloc(64);
 
-	// find best cam mode
-	if((width == 0 && height == 0) || width > 320 || height > 240)
-	{
-		frame_width = 640;
-		frame_height = 480;
-	} else {
-		frame_width = 320;
-		frame_height = 240;
-	}
+	select_mode(width, height);
 	frame_rate = ov534_set_frame_rate(desiredFrameRate, true);
 	frame_output_format = outputFormat;
+	frame_queue_depth = (std::max)(queueDepth, 2u);
+	frame_drop_policy = dropPolicy;
+	transfer_count = (std::min)((std::max)(transferCount, 1u), (uint32_t)MAX_TRANSFERS);
+	// Transfers must hold whole payloads, pkt_scan can't parse one that is split across two of them
+	transfer_size = (std::max)((transferSize + PAYLOAD_SIZE - 1) / PAYLOAD_SIZE, 1u) * PAYLOAD_SIZE;
 	//
 
 	/* reset bridge */
@@ -1096,6 +1565,7 @@ bool PS3EYECam::init(uint32_t width, uint32_t height, uint16_t desiredFrameRate,
 	sccb_reg_read(0x0b);
 	sensor_id |= sccb_reg_read(0x0b);
 	debug("Sensor ID: %04x\n", sensor_id);
+	debug("Debayer kernel: %s\n", DebayerKernelName(DebayerGetKernel()));
 
 	/* initialize */
 	reg_w_array(ov534_reg_initdata, ARRAY_SIZE(ov534_reg_initdata));
@@ -1107,17 +1577,36 @@ bool PS3EYECam::init(uint32_t width, uint32_t height, uint16_t desiredFrameRate,
 	return true;
 }
 
-void PS3EYECam::start()
+void PS3EYECam::select_mode(uint32_t width, uint32_t height)
 {
-    if(is_streaming) return;
-    
-	if (frame_width == 320) {	/* 320x240 */
+	// find best cam mode
+	if((width == 0 && height == 0) || width > 320 || height > 240)
+	{
+		frame_width = 640;
+		frame_height = 480;
+	} else {
+		frame_width = 320;
+		frame_height = 240;
+	}
+	sensor_width = frame_width;
+	sensor_height = frame_height;
+	window_x = 0;
+	window_y = 0;
+}
+
+/* Program the sensor mode, window, frame rate and controls. The register shadow skips whatever is already set, so
+ * going over all of it again when only some of it changed is cheap. */
+void PS3EYECam::apply_mode()
+{
+	if (sensor_width == 320) {	/* 320x240 */
 		reg_w_array(bridge_start_qvga, ARRAY_SIZE(bridge_start_qvga));
 		sccb_w_array(sensor_start_qvga, ARRAY_SIZE(sensor_start_qvga));
 	} else {		/* 640x480 */
 		reg_w_array(bridge_start_vga, ARRAY_SIZE(bridge_start_vga));
 		sccb_w_array(sensor_start_vga, ARRAY_SIZE(sensor_start_vga));
 	}
+	if (frame_width != sensor_width || frame_height != sensor_height)
+		ov534_set_window();
 
 	ov534_set_frame_rate(frame_rate);
 
@@ -1133,13 +1622,74 @@ void PS3EYECam::start()
 	setBlueBalance(blueblc);
 	setGreenBalance(greenblc);
     setFlip(flip_h, flip_v);
+}
+
+void PS3EYECam::start()
+{
+    if(is_streaming) return;
+
+	start_stream();
+    is_streaming = true;
+}
+
+void PS3EYECam::start_stream()
+{
+	apply_mode();
 
 	ov534_set_led(1);
 	ov534_reg_write(0xe0, 0x00); // start stream
 
-	// init and start urb
-	urb->start_transfers(handle_, frame_width*frame_height);
-    is_streaming = true;
+	// init and start urb. The frame buffers hold a full sensor frame, so windows and frame rates can be changed
+	// while streaming without reallocating them.
+	update_stall_timeout();
+	urb->start_transfers(handle_, frame_width, frame_height, sensor_width*sensor_height, frame_queue_depth, frame_drop_policy,
+						 transfer_count, transfer_size, use_device_memory);
+}
+
+/* Switch a running stream over to the mode set in the members: pause the bridge, reprogram, resume. The transfers stay
+ * submitted, and the frame queue stays too unless the new frames don't fit it. */
+void PS3EYECam::restart_stream()
+{
+	// Picked up by reconnect
+	if (!isConnected())
+		return;
+
+	ov534_reg_write(0xe0, 0x09); // stop stream
+
+	if (frame_width * frame_height > urb->get_frame_capacity())
+	{
+		urb->close_transfers();
+		apply_mode();
+		ov534_reg_write(0xe0, 0x00);
+		urb->start_transfers(handle_, frame_width, frame_height, sensor_width*sensor_height, frame_queue_depth, frame_drop_policy,
+							 transfer_count, transfer_size, use_device_memory);
+		return;
+	}
+
+	urb->set_frame_size(frame_width, frame_height);
+	apply_mode();
+	ov534_reg_write(0xe0, 0x00); // start stream
+}
+
+bool PS3EYECam::reconfigure(uint32_t width, uint32_t height, uint16_t desiredFrameRate)
+{
+	if (!isInitialized()) return false;
+
+	select_mode(width, height);
+	frame_rate = ov534_set_frame_rate(desiredFrameRate, true);
+	update_stall_timeout();
+	if (is_streaming)
+		restart_stream();
+	return true;
+}
+
+bool PS3EYECam::setFrameRate(uint16_t val)
+{
+	// Only the clock divider and PLL of the sensor and the matching bridge register change, nothing to pause for.
+	// The frame in progress may come out short and is dropped.
+	frame_rate = ov534_set_frame_rate(val, !is_streaming);
+	update_stall_timeout();
+	return true;
 }
 
 void PS3EYECam::stop()
@@ -1147,13 +1697,77 @@ void PS3EYECam::stop()
     if(!is_streaming) return;
 
 	/* stop streaming data */
-	ov534_reg_write(0xe0, 0x09);
-	ov534_set_led(0);
+	if (isConnected()) {
+		ov534_reg_write(0xe0, 0x09);
+		ov534_set_led(0);
+	}
     
 	// close urb
 	urb->close_transfers();
 
     is_streaming = false;
+    stream_lost = false;
+}
+
+bool PS3EYECam::isConnected() const
+{
+	return !stream_lost && !(is_streaming && urb->is_device_lost());
+}
+
+/* Bring a stream whose device went away back up on the camera plugged into the same port, with the same settings.
+ * A stalled stream on a device that is still there is restarted straight away. Once the device has been found
+ * missing, tries again when a PS3 Eye is plugged in, or every RECONNECT_INTERVAL_US if libusb can't tell. */
+bool PS3EYECam::reconnect()
+{
+	uint32_t arrivals = mgrPtr->getArrivalCount();
+	uint64_t now = monotonic_time_us();
+	if (reconnect_missing && arrivals == reconnect_arrivals && now - reconnect_time < RECONNECT_INTERVAL_US)
+		return false;
+
+	libusb_device* device = mgrPtr->findDeviceAtPort(device_);
+	reconnect_missing = device == NULL;
+	if (reconnect_missing) {
+		reconnect_arrivals = arrivals;
+		reconnect_time = now;
+		return false;
+	}
+	debug("reconnecting\n");
+	bool recovering_stall = urb->is_stalled();
+
+	// Everything of the old stream goes, but the USB thread keeps running until the new one has started
+	mgrPtr->cameraStarted();
+	urb->close_transfers();
+	stream_lost = true;
+	if (handle_ != NULL)
+		close_usb();
+	else
+		libusb_unref_device(device_);
+	device_ = device;
+
+	uint32_t width = frame_width;
+	uint32_t height = frame_height;
+	uint32_t x = window_x;
+	uint32_t y = window_y;
+	bool ok = init(sensor_width, sensor_height, frame_rate, frame_output_format, frame_queue_depth, frame_drop_policy,
+				   transfer_count, transfer_size);
+	if (ok) {
+		setWindow(x, y, width, height);
+		start_stream();
+		stream_lost = false;
+		if (recovering_stall)
+			++stall_recovery_count;
+		else
+			++reconnect_count;
+	} else {
+		// Keep the settings for the next attempt
+		frame_width = width;
+		frame_height = height;
+		window_x = x;
+		window_y = y;
+		debug("reconnect failed\n");
+	}
+	mgrPtr->cameraStopped();
+	return ok;
 }
 
 #define MAX_USB_DEVICE_PORT_PATH 7
@@ -1162,7 +1776,8 @@ bool PS3EYECam::getUSBPortPath(char *out_identifier, size_t max_identifier_lengt
 {
     bool success = false;
 
-    if (isInitialized())
+    // Only depends on where the device is plugged in, so it works before init() as well
+    if (device_ != NULL)
     {
         uint8_t port_numbers[MAX_USB_DEVICE_PORT_PATH];
 
@@ -1211,12 +1826,218 @@ uint32_t PS3EYECam::getOutputBytesPerPixel() const
 		return 3;
 	else if (frame_output_format == EOutputFormat::Gray)
 		return 1;
+	else if (frame_output_format == EOutputFormat::HalfGray)
+		return 1;
+	else if (frame_output_format == EOutputFormat::HalfBGR)
+		return 3;
+	else if (frame_output_format == EOutputFormat::HalfRGB)
+		return 3;
+	// Planar formats: bytes per pixel of the first plane
+	else if (frame_output_format == EOutputFormat::PlanarRGB ||
+			 frame_output_format == EOutputFormat::HalfPlanarRGB)
+		return 1;
+	else if (frame_output_format == EOutputFormat::I420 ||
+			 frame_output_format == EOutputFormat::NV12 ||
+			 frame_output_format == EOutputFormat::HalfI420 ||
+			 frame_output_format == EOutputFormat::HalfNV12)
+		return 1;
 	return 0;
 }
 
-void PS3EYECam::getFrame(uint8_t* frame)
+static bool is_half_resolution(PS3EYECam::EOutputFormat format)
+{
+	return format == PS3EYECam::EOutputFormat::HalfGray ||
+		   format == PS3EYECam::EOutputFormat::HalfBGR ||
+		   format == PS3EYECam::EOutputFormat::HalfRGB ||
+		   format == PS3EYECam::EOutputFormat::HalfPlanarRGB ||
+		   format == PS3EYECam::EOutputFormat::HalfI420 ||
+		   format == PS3EYECam::EOutputFormat::HalfNV12;
+}
+
+uint32_t PS3EYECam::getOutputWidth() const
+{
+	return is_half_resolution(frame_output_format) ? frame_width / 2 : frame_width;
+}
+
+uint32_t PS3EYECam::getOutputHeight() const
+{
+	return is_half_resolution(frame_output_format) ? frame_height / 2 : frame_height;
+}
+
+uint32_t PS3EYECam::getOutputSize() const
+{
+	uint32_t pixels = getOutputWidth() * getOutputHeight();
+	switch (frame_output_format) {
+	case EOutputFormat::PlanarRGB:
+	case EOutputFormat::HalfPlanarRGB:
+		return pixels * 3;
+	case EOutputFormat::I420:
+	case EOutputFormat::NV12:
+	case EOutputFormat::HalfI420:
+	case EOutputFormat::HalfNV12:
+		return pixels * 3 / 2;
+	default:
+		return pixels * getOutputBytesPerPixel();
+	}
+}
+
+void PS3EYECam::setStallTimeout(uint32_t frameIntervals)
+{
+	stall_intervals = frameIntervals;
+	update_stall_timeout();
+}
+
+/* Expected time between frames, taking decimation into account, times stall_intervals */
+void PS3EYECam::update_stall_timeout()
+{
+	uint64_t timeout = 0;
+	if (stall_intervals != 0 && frame_rate != 0) {
+		timeout = (uint64_t)stall_intervals * urb->decimation_interval.load() * 1000000 / frame_rate;
+		timeout = (std::max)(timeout, (uint64_t)MIN_STALL_TIMEOUT_US);
+	}
+	urb->set_stall_timeout(timeout);
+}
+
+bool PS3EYECam::getFrame(uint8_t* frame, FrameInfo* info)
+{
+	for (;;) {
+		if (!is_streaming || (!isConnected() && !reconnect()))
+			return false;
+		std::shared_ptr<FrameQueue> queue = urb->get_frame_queue();
+		if (!queue)
+			return false;
+		if (queue->Dequeue(frame, frame_output_format, info))
+			return true;
+		// A stall is recovered from on the spot, for an unplugged camera there's nothing to wait for
+		if (!urb->is_stalled())
+			return false;
+	}
+}
+
+PS3EYECam::FrameLease PS3EYECam::leaseFrame()
+{
+	std::shared_ptr<FrameQueue> queue;
+	uint32_t index;
+	for (;;) {
+		if (!is_streaming || (!isConnected() && !reconnect()))
+			return FrameLease();
+		queue = urb->get_frame_queue();
+		if (!queue)
+			return FrameLease();
+		index = queue->Claim();
+		if (index != FrameQueue::NO_FRAME)
+			break;
+		if (!urb->is_stalled())
+			return FrameLease();
+	}
+	const FrameInfo& info = queue->GetFrameInfo(index);
+	return FrameLease(queue, index, queue->GetFrame(index), info, info.width, info.height);
+}
+
+PS3EYECam::FrameLease::FrameLease() :
+	index	(0),
+	data	(NULL),
+	info	(),
+	width	(0),
+	height	(0)
+{
+}
+
+PS3EYECam::FrameLease::FrameLease(const std::shared_ptr<FrameQueue>& queue, uint32_t index, const uint8_t* data, const FrameInfo& info, uint32_t width, uint32_t height) :
+	queue	(queue),
+	index	(index),
+	data	(data),
+	info	(info),
+	width	(width),
+	height	(height)
+{
+}
+
+PS3EYECam::FrameLease::FrameLease(FrameLease&& other) :
+	queue	(std::move(other.queue)),
+	index	(other.index),
+	data	(other.data),
+	info	(other.info),
+	width	(other.width),
+	height	(other.height)
+{
+	other.data = NULL;
+}
+
+PS3EYECam::FrameLease& PS3EYECam::FrameLease::operator=(FrameLease&& other)
+{
+	if (this != &other)
+	{
+		release();
+		queue = std::move(other.queue);
+		index = other.index;
+		data = other.data;
+		info = other.info;
+		width = other.width;
+		height = other.height;
+		other.data = NULL;
+	}
+	return *this;
+}
+
+PS3EYECam::FrameLease::~FrameLease()
+{
+	release();
+}
+
+void PS3EYECam::FrameLease::release()
+{
+	if (!queue)
+		return;
+
+	queue->Release(index);
+	queue.reset();
+	data = NULL;
+}
+
+PS3EYECam::QueueStats PS3EYECam::getQueueStats() const
+{
+	std::shared_ptr<FrameQueue> queue = urb->get_frame_queue();
+	if (!queue)
+		return QueueStats();
+	return queue->GetStats();
+}
+
+void PS3EYECam::setUseDeviceMemory(bool enable)
+{
+	use_device_memory = enable;
+}
+
+bool PS3EYECam::isUsingDeviceMemory() const
+{
+	return urb->transfer_buffer_mapped;
+}
+
+void PS3EYECam::setDecimation(uint32_t frameInterval, bool skipWhenBusy)
+{
+	urb->decimation_interval.store((std::max)(frameInterval, 1u));
+	urb->skip_when_busy.store(skipWhenBusy);
+	update_stall_timeout();
+}
+
+uint32_t PS3EYECam::getDecimationInterval() const
 {
-	urb->frame_queue->Dequeue(frame, frame_width, frame_height, frame_output_format);
+	return urb->decimation_interval.load();
+}
+
+bool PS3EYECam::getSkipWhenBusy() const
+{
+	return urb->skip_when_busy.load();
+}
+
+libusb_context* PS3EYECam::getUSBContext()
+{
+	return USBMgr::instance()->getContext();
+}
+
+PS3EYECam::StreamStats PS3EYECam::getStats() const
+{
+	return urb->stats.Get();
 }
 
 bool PS3EYECam::open_usb()
@@ -1228,6 +2049,9 @@ bool PS3EYECam::open_usb()
 		return false;
 	}
 
+	// A freshly opened device is in whatever state the last user left it in
+	invalidate_shadows();
+
 	//libusb_set_configuration(handle_, 0);
 
 	res = libusb_claim_interface(handle_, 0);
@@ -1329,7 +2153,7 @@ uint16_t PS3EYECam::ov534_set_frame_rate(uint16_t frame_rate, bool dry_run)
              {2, 0x18, 0x01, 0x02},
      };
 
-     if (frame_width == 640) {
+     if (sensor_width == 640) {
              r = rate_0;
              i = ARRAY_SIZE(rate_0);
      } else {
@@ -1352,10 +2176,100 @@ uint16_t PS3EYECam::ov534_set_frame_rate(uint16_t frame_rate, bool dry_run)
      return r->fps;
 }
 
+bool PS3EYECam::setWindow(uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+	x &= ~3u;
+	y &= ~1u;
+	width &= ~7u;
+	height &= ~7u;
+	if (width == 0 || height == 0 || x + width > sensor_width || y + height > sensor_height)
+		return false;
+
+	window_x = x;
+	window_y = y;
+	frame_width = width;
+	frame_height = height;
+	if (is_streaming)
+		restart_stream();
+	return true;
+}
+
+void PS3EYECam::resetWindow()
+{
+	setWindow(0, 0, sensor_width, sensor_height);
+}
+
+/* Replaces the full frame window set up by the sensor_start and bridge_start tables */
+void PS3EYECam::ov534_set_window()
+{
+	/* Window start and size count 4 pixels horizontally and 2 lines vertically; the LSBs in HREF (0x32) and
+	 * EXHCH (0x2a) stay 0, which also keeps the window on the GRBG phase of the full frame. */
+	uint8_t hstart = (sensor_width == 320) ? 0x3f : 0x26;
+	uint8_t vstart = (sensor_width == 320) ? 0x03 : 0x07;
+
+	sccb_reg_write(0x17, hstart + window_x / 4);	/* HSTART */
+	sccb_reg_write(0x18, frame_width / 4);			/* HSIZE */
+	sccb_reg_write(0x19, vstart + window_y / 2);	/* VSTRT */
+	sccb_reg_write(0x1a, frame_height / 2);			/* VSIZE */
+	sccb_reg_write(0x29, frame_width / 4);			/* HOutSize */
+	sccb_reg_write(0x2c, frame_height / 2);			/* VOutSize */
+
+	/* Bridge: frame size in 4 byte units, then line width and line count in units of 8 */
+	uint32_t frame_size = frame_width * frame_height / 4;
+	ov534_reg_write(0x1c, 0x00);
+	ov534_reg_write(0x1d, 0x00);
+	ov534_reg_write(0x1d, 0x02);
+	ov534_reg_write(0x1d, 0x00);
+	ov534_reg_write(0x1d, (frame_size >> 16) & 0xff);
+	ov534_reg_write(0x1d, (frame_size >> 8) & 0xff);
+	ov534_reg_write(0x1d, frame_size & 0xff);
+	ov534_reg_write(0xc0, frame_width / 8);
+	ov534_reg_write(0xc1, frame_height / 8);
+}
+
+/* Bridge registers whose value is simply what was last written to them. The others are command, index/data port or
+ * reset registers (0x1c/0x1d frame setup, 0x96/0x97 the table written by ov534_reg_initdata, 0xe0 stream control,
+ * 0xe7 reset, 0xf1-0xf6 SCCB interface), where a write is an action that must not be skipped. */
+static bool ov534_reg_cacheable(uint16_t reg)
+{
+	return reg < 0xf0 && reg != 0x1c && reg != 0x1d && reg != 0x96 && reg != 0x97 && reg != 0xe0 && reg != 0xe7;
+}
+
+/* Sensor registers the OV772x doesn't change on its own. Gain, exposure and white balance gains are updated by
+ * AGC/AEC/AWB, the dummy line count
+ * follows night mode, and 0xff is used by the init sequences as a dummy. */
+static bool sccb_reg_cacheable(uint8_t reg)
+{
+	switch (reg) {
+	case 0x00:	/* GAIN */
+	case 0x01:	/* BLUE */
+	case 0x02:	/* RED */
+	case 0x08:	/* AECH */
+	case 0x10:	/* AEC */
+	case 0x2d:	/* ADVFL */
+	case 0x2e:	/* ADVFH */
+	case 0xff:
+		return false;
+	default:
+		return true;
+	}
+}
+
+void PS3EYECam::invalidate_shadows()
+{
+	for (int reg = 0; reg < 256; ++reg) {
+		ov534_shadow[reg] = -1;
+		sccb_shadow[reg] = -1;
+	}
+}
+
 void PS3EYECam::ov534_reg_write(uint16_t reg, uint8_t val)
 {
 	int ret;
 
+	if (handle_ == NULL || (ov534_reg_cacheable(reg) && ov534_shadow[reg] == val))
+		return;
+
 	//debug("reg=0x%04x, val=0%02x", reg, val);
 	usb_buf[0] = val;
 
@@ -1364,8 +2278,12 @@ void PS3EYECam::ov534_reg_write(uint16_t reg, uint8_t val)
 							LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE, 
 							0x01, 0x00, reg,
 							usb_buf, 1, 500);
-	if (ret < 0) {
-		debug("write failed\n");
+
+	if (reg == 0xe7) {
+		/* bridge reset */
+		invalidate_shadows();
+	} else if (ov534_reg_cacheable(reg)) {
+		ov534_shadow[reg] = ret < 0 ? -1 : val;
 	}
 }
 
@@ -1373,6 +2291,11 @@ uint8_t PS3EYECam::ov534_reg_read(uint16_t reg)
 {
 	int ret;
 
+	if (ov534_reg_cacheable(reg) && ov534_shadow[reg] >= 0)
+		return (uint8_t)ov534_shadow[reg];
+	if (handle_ == NULL)
+		return 0;
+
 	ret = libusb_control_transfer(handle_,
 							LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE, 
 							0x01, 0x00, reg,
@@ -1381,11 +2304,101 @@ uint8_t PS3EYECam::ov534_reg_read(uint16_t reg)
 	//debug("reg=0x%04x, data=0x%02x", reg, usb_buf[0]);
 	if (ret < 0) {
 		debug("read failed\n");
-	
+		return usb_buf[0];
 	}
+	if (ov534_reg_cacheable(reg))
+		ov534_shadow[reg] = usb_buf[0];
 	return usb_buf[0];
 }
 
+#if defined(PS3EYE_PIPELINED_CONTROL)
+struct ControlBatch
+{
+	std::atomic<int>	pending;
+	int					completed;
+	bool				failed;
+};
+
+static void LIBUSB_CALL control_batch_callback(struct libusb_transfer *xfr)
+{
+	ControlBatch* batch = reinterpret_cast<ControlBatch*>(xfr->user_data);
+	if (xfr->status != LIBUSB_TRANSFER_COMPLETED)
+		batch->failed = true;
+	if (--batch->pending == 0)
+		batch->completed = 1;
+}
+#endif
+
+/* Write a sequence of bridge registers with the control transfers pipelined: they are all submitted up front and
+ * the device works through them in order (see PS3EYE_PIPELINED_CONTROL), so the whole sequence costs about one round
+ * trip instead of one each. Writes the shadow makes redundant are dropped. */
+void PS3EYECam::ov534_reg_write_batch(const uint8_t (*data)[2], int len)
+{
+	if (handle_ == NULL)
+		return;
+
+#if !defined(PS3EYE_PIPELINED_CONTROL)
+	for (int index = 0; index < len; ++index)
+		ov534_reg_write(data[index][0], data[index][1]);
+#else
+
+	const int entry_size = LIBUSB_CONTROL_SETUP_SIZE + 1;
+	std::vector<uint8_t> buffer(len * entry_size);
+	std::vector<libusb_transfer*> xfrs;
+	xfrs.reserve(len);
+
+	ControlBatch batch;
+	batch.pending = 0;
+	batch.completed = 0;
+	batch.failed = false;
+
+	int index;
+	for (index = 0; index < len; ++index) {
+		uint8_t reg = data[index][0];
+		uint8_t val = data[index][1];
+		if (ov534_reg_cacheable(reg) && ov534_shadow[reg] == val)
+			continue;
+
+		uint8_t* entry = &buffer[index * entry_size];
+		libusb_fill_control_setup(entry, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+								  0x01, 0x00, reg, 1);
+		entry[LIBUSB_CONTROL_SETUP_SIZE] = val;
+
+		libusb_transfer* xfr = libusb_alloc_transfer(0);
+		libusb_fill_control_transfer(xfr, handle_, entry, control_batch_callback, &batch, 500);
+		++batch.pending;
+		if (libusb_submit_transfer(xfr) != 0) {
+			--batch.pending;
+			libusb_free_transfer(xfr);
+			break;
+		}
+		xfrs.push_back(xfr);
+
+		if (reg == 0xe7)
+			invalidate_shadows();
+		else if (ov534_reg_cacheable(reg))
+			ov534_shadow[reg] = val;
+	}
+
+	if (batch.pending == 0)
+		batch.completed = 1;
+	while (!batch.completed)
+		libusb_handle_events_completed(mgrPtr->getContext(), &batch.completed);
+
+	for (size_t xfr_index = 0; xfr_index < xfrs.size(); ++xfr_index)
+		libusb_free_transfer(xfrs[xfr_index]);
+
+	if (batch.failed) {
+		debug("batched write failed\n");
+		invalidate_shadows();
+	}
+
+	/* Couldn't submit: do the rest one by one, which goes through the same shadow */
+	for (; index < len; ++index)
+		ov534_reg_write(data[index][0], data[index][1]);
+#endif
+}
+
 int PS3EYECam::sccb_check_status()
 {
 	uint8_t data;
@@ -1411,21 +2424,43 @@ int PS3EYECam::sccb_check_status()
 
 void PS3EYECam::sccb_reg_write(uint8_t reg, uint8_t val)
 {
+	if (sccb_reg_cacheable(reg) && sccb_shadow[reg] == val)
+		return;
+
 	//debug("reg: 0x%02x, val: 0x%02x", reg, val);
-	ov534_reg_write(OV534_REG_SUBADDR, reg);
-	ov534_reg_write(OV534_REG_WRITE, val);
-	ov534_reg_write(OV534_REG_OPERATION, OV534_OP_WRITE_3);
+	const uint8_t sequence[][2] = {
+		{ OV534_REG_SUBADDR, reg },
+		{ OV534_REG_WRITE, val },
+		{ OV534_REG_OPERATION, OV534_OP_WRITE_3 },
+	};
+	ov534_reg_write_batch(sequence, ARRAY_SIZE(sequence));
 
 	if (!sccb_check_status()) {
 		debug("sccb_reg_write failed\n");
-}
+		sccb_shadow[reg] = -1;
+		return;
+	}
+
+	if (reg == 0x12 && (val & 0x80)) {
+		/* COM7 soft reset: every register is back at its default */
+		for (int index = 0; index < 256; ++index)
+			sccb_shadow[index] = -1;
+	} else if (sccb_reg_cacheable(reg)) {
+		sccb_shadow[reg] = val;
+	}
 }
 
 
 uint8_t PS3EYECam::sccb_reg_read(uint16_t reg)
 {
-	ov534_reg_write(OV534_REG_SUBADDR, (uint8_t)reg);
-	ov534_reg_write(OV534_REG_OPERATION, OV534_OP_WRITE_2);
+	if (reg < 256 && sccb_reg_cacheable((uint8_t)reg) && sccb_shadow[reg] >= 0)
+		return (uint8_t)sccb_shadow[reg];
+
+	const uint8_t sequence[][2] = {
+		{ OV534_REG_SUBADDR, (uint8_t)reg },
+		{ OV534_REG_OPERATION, OV534_OP_WRITE_2 },
+	};
+	ov534_reg_write_batch(sequence, ARRAY_SIZE(sequence));
 	if (!sccb_check_status()) {
 		debug("sccb_reg_read failed 1\n");
 	}
@@ -1433,17 +2468,18 @@ uint8_t PS3EYECam::sccb_reg_read(uint16_t reg)
 	ov534_reg_write(OV534_REG_OPERATION, OV534_OP_READ_2);
 	if (!sccb_check_status()) {
 		debug( "sccb_reg_read failed 2\n");
+		return ov534_reg_read(OV534_REG_READ);
 	}
 
-	return ov534_reg_read(OV534_REG_READ);
+	uint8_t val = ov534_reg_read(OV534_REG_READ);
+	if (reg < 256 && sccb_reg_cacheable((uint8_t)reg))
+		sccb_shadow[reg] = val;
+	return val;
 }
 /* output a bridge sequence (reg - val) */
 void PS3EYECam::reg_w_array(const uint8_t (*data)[2], int len)
 {
-	while (--len >= 0) {
-		ov534_reg_write((*data)[0], (*data)[1]);
-		data++;
-	}
+	ov534_reg_write_batch(data, len);
 }
 
 /* output a sensor sequence (reg - val) */
@@ -37,6 +37,8 @@
 
 namespace ps3eye {
 
+class FrameQueue;
+
 class PS3EYECam
 {
 public:
@@ -45,18 +47,117 @@ public:
 		Bayer,					// Output in Bayer. Destination buffer must be width * height bytes
 		BGR,					// Output in BGR. Destination buffer must be width * height * 3 bytes
 		RGB	,					// Output in RGB. Destination buffer must be width * height * 3 bytes
-		Gray					// Output in Grayscale. Destination buffer must be width * height bytes
+		Gray,					// Output in Grayscale. Destination buffer must be width * height bytes
+		HalfGray,				// Output in Grayscale at half resolution, one pixel per 2x2 Bayer quad. Destination buffer must be width/2 * height/2 bytes
+		PlanarRGB,				// Output in three planes, R, G, B. Destination buffer must be width * height * 3 bytes
+		I420,					// Output in YUV 4:2:0 (full range BT.601), Y plane then U and V planes. Destination buffer must be width * height * 3 / 2 bytes
+		NV12,					// Like I420, but U and V interleaved in a single plane. Destination buffer must be width * height * 3 / 2 bytes
+		HalfBGR,				// The half resolution variants take one pixel per 2x2 Bayer quad like HalfGray, and need the buffer of
+		HalfRGB,				// their full resolution counterparts for width/2 x height/2
+		HalfPlanarRGB,
+		HalfI420,
+		HalfNV12
+	};
+
+	// What happens when a frame completes and getFrame has not released a buffer to continue in
+	enum class EDropPolicy
+	{
+		DropNewest,				// Overwrite the frame that just completed. The consumer sees the oldest frames
+		DropOldest,				// Discard the oldest frame still waiting in the queue
+		LatestOnly,				// Like DropOldest, and getFrame also skips to the newest frame waiting in the queue
+		BlockProducer			// Stop reading from this camera until a buffer is free. Nothing queued is lost, but the camera drops data instead
+	};
+
+	// Frame counters since start()
+	struct QueueStats
+	{
+		uint64_t produced = 0;	// Frames completed by the USB thread
+		uint64_t delivered = 0;	// Frames handed out by getFrame
+		uint64_t dropped = 0;	// Frames discarded because of the drop policy
+	};
+
+	// Packet stream counters since start(), for diagnosing USB bandwidth problems. Payloads with a bad header, an error
+	// flag or no PTS are discarded, as are frames that overflow the buffer (oversize), end with the wrong number of bytes
+	// (short) or are cut off by the start of the next frame (incomplete).
+	struct StreamStats
+	{
+		uint64_t bytes = 0;				// Bytes received from the bulk endpoint
+		uint64_t payloads = 0;			// UVC payloads scanned
+		uint64_t badHeaders = 0;
+		uint64_t payloadErrors = 0;
+		uint64_t missingPts = 0;
+		uint64_t oversizeFrames = 0;
+		uint64_t shortFrames = 0;
+		uint64_t frames = 0;			// Complete frames handed to the frame queue
+		uint64_t incompleteFrames = 0;
+		uint64_t skippedFrames = 0;		// Frames not copied at all because of setDecimation, or BlockProducer ran out of buffers
+		uint64_t minFrameInterval = 0;	// Time between the arrival of consecutive complete frames, in microseconds
+		uint64_t avgFrameInterval = 0;
+		uint64_t maxFrameInterval = 0;
+	};
+
+	// Timing of a frame, filled in by getFrame and leaseFrame
+	struct FrameInfo
+	{
+		uint64_t sequence = 0;	// Number of frames completed before this one since start(). Gaps mean frames were dropped
+		uint32_t pts = 0;		// Presentation timestamp from the UVC payload headers, in bridge clock ticks
+		uint64_t arrival = 0;	// Host monotonic time (CLOCK_MONOTONIC where available) at which the first packet of the frame arrived, in microseconds
+		uint32_t width = 0;		// Size of the Bayer frame. Only differs from getWidth/getHeight for frames queued before a reconfigure
+		uint32_t height = 0;
+	};
+
+	// Read-only view of a raw Bayer frame (width * height bytes, GRBG) inside the frame queue, handed out by leaseFrame.
+	// The USB thread can't reuse the buffer until the lease is released or destroyed, so hold on to it only as long as
+	// needed. It stays valid across stop(), reconfigure and reconnects, which start a new frame queue.
+	class FrameLease
+	{
+	public:
+		FrameLease();
+		FrameLease(FrameLease&& other);
+		FrameLease& operator=(FrameLease&& other);
+		~FrameLease();
+
+		bool isValid() const { return data != NULL; }
+		const uint8_t* getData() const { return data; }
+		uint32_t getWidth() const { return width; }
+		uint32_t getHeight() const { return height; }
+		const FrameInfo& getInfo() const { return info; }
+
+		void release();
+
+	private:
+		friend class PS3EYECam;
+		FrameLease(const std::shared_ptr<FrameQueue>& queue, uint32_t index, const uint8_t* data, const FrameInfo& info, uint32_t width, uint32_t height);
+		FrameLease(const FrameLease&);
+		void operator=(const FrameLease&);
+
+		std::shared_ptr<FrameQueue> queue;
+		uint32_t index;
+		const uint8_t* data;
+		FrameInfo info;
+		uint32_t width;
+		uint32_t height;
 	};
 
 	typedef std::shared_ptr<PS3EYECam> PS3EYERef;
 
 	static const uint16_t VENDOR_ID;
 	static const uint16_t PRODUCT_ID;
+	static const uint32_t DEFAULT_TRANSFER_COUNT;
+	static const uint32_t DEFAULT_TRANSFER_SIZE;
+	static const uint32_t DEFAULT_STALL_INTERVALS;
 
 	PS3EYECam(libusb_device *device);
 	~PS3EYECam();
 
-	bool init(uint32_t width = 0, uint32_t height = 0, uint16_t desiredFrameRate = 30, EOutputFormat outputFormat = EOutputFormat::BGR);
+	// queueDepth is the number of frame buffers (at least 2): one is always being filled from USB, the others hold
+	// completed frames until getFrame picks them up.
+	// transferCount bulk transfers of transferSize bytes each are kept in flight. More or larger transfers ride out
+	// longer host stalls at the cost of latency; the best values depend on the host controller and resolution
+	// (see ps3eye-bench). transferSize is rounded up to a multiple of the 2048 byte UVC payload size.
+	bool init(uint32_t width = 0, uint32_t height = 0, uint16_t desiredFrameRate = 30, EOutputFormat outputFormat = EOutputFormat::BGR,
+			  uint32_t queueDepth = 2, EDropPolicy dropPolicy = EDropPolicy::DropNewest,
+			  uint32_t transferCount = DEFAULT_TRANSFER_COUNT, uint32_t transferSize = DEFAULT_TRANSFER_SIZE);
 	void start();
 	void stop();
 
@@ -163,6 +264,19 @@ public:
     
 
     bool isStreaming() const { return is_streaming; }
+	// False from the moment a streaming camera stops responding (unplugged, usually) until it has been reconnected.
+	// getFrame and leaseFrame do the reconnecting: while the camera is away they fail straight away, and once a PS3 Eye
+	// shows up on the same USB port they init and start it with the same settings and carry on.
+	bool isConnected() const;
+	uint32_t getReconnectCount() const { return reconnect_count; }
+
+	// Stall watchdog: if a stream goes frameIntervals frame intervals (at the current frame rate and decimation, but at
+	// least 200ms) without a complete frame, even though the camera is still there, it is given up on like an unplugged
+	// one and getFrame/leaseFrame immediately reset the bridge and sensor and restart it. 0 turns the watchdog off.
+	// Defaults to DEFAULT_STALL_INTERVALS.
+	void setStallTimeout(uint32_t frameIntervals);
+	uint32_t getStallTimeout() const { return stall_intervals; }
+	uint32_t getStallRecoveryCount() const { return stall_recovery_count; }
     bool isInitialized() const { return device_ != NULL && handle_ != NULL && usb_buf != NULL; }
 
 	bool getUSBPortPath(char *out_identifier, size_t max_identifier_length) const;
@@ -170,22 +284,77 @@ public:
 	// Get a frame from the camera. Notes:
 	// - If there is no frame available, this function will block until one is
 	// - The output buffer must be sized correctly, depending out the output format. See EOutputFormat.
-	void getFrame(uint8_t* frame);
+	// - If info is not NULL, it receives the timestamps of the frame
+	// - Returns false without a frame if the camera is not streaming or has been disconnected (see isConnected), also
+	//   when that happens while waiting. Back off a little before asking again.
+	bool getFrame(uint8_t* frame, FrameInfo* info = NULL);
+
+	// Get the next frame without copying it. Blocks like getFrame, but returns the raw Bayer buffer from the frame
+	// queue regardless of the output format, for consumers that only need part of the frame or convert it themselves.
+	// The lease is invalid where getFrame would return false.
+	FrameLease leaseFrame();
 
 	uint32_t getWidth() const { return frame_width; }
 	uint32_t getHeight() const { return frame_height; }
+
+	// Sensor windowing: read out only the width x height window at (x, y) of the sensor mode chosen by init (640x480 or
+	// 320x240), in unflipped sensor coordinates. getWidth/getHeight, getFrame and the frame queue all follow the window.
+	// Less data per frame leaves USB bandwidth for the frame rates it otherwise limits (83 fps at VGA, 205+ at QVGA).
+	// x is rounded down to a multiple of 4, y to a multiple of 2 and the size to multiples of 8. init and reconfigure
+	// reset to the full frame. Can be changed while streaming, like reconfigure.
+	bool setWindow(uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+	void resetWindow();
+	uint32_t getWindowX() const { return window_x; }
+	uint32_t getWindowY() const { return window_y; }
+	uint32_t getSensorWidth() const { return sensor_width; }
+	uint32_t getSensorHeight() const { return sensor_height; }
 	uint16_t getFrameRate() const { return frame_rate; }
-	bool setFrameRate(uint8_t val) {
-		if (is_streaming) return false;
-		frame_rate = ov534_set_frame_rate(val, true);
-		return true;
-	}
-	uint32_t getRowBytes() const { return frame_width * getOutputBytesPerPixel(); }
+	// Picks the closest supported rate at or below val for the current sensor mode (see getFrameRate). Takes effect
+	// immediately when streaming, without interrupting the stream.
+	bool setFrameRate(uint16_t val);
+	// Switch the size and frame rate chosen by init without going through stop/init/start. While streaming the bridge
+	// pauses for a frame or two while the sensor is reprogrammed, but the transfers and the frame queue stay as they are,
+	// unless going from 320x240 to 640x480 outgrows the queue: then the transfers are restarted as in stop/start, and a
+	// consumer waiting in getFrame/leaseFrame returns false. Frames queued before the switch keep their old size (see
+	// FrameInfo), so size getFrame's buffer for the larger of the two or drain the queue first.
+	bool reconfigure(uint32_t width, uint32_t height, uint16_t desiredFrameRate);
+	// Size of the frames getFrame writes, which differs from the sensor size for the half resolution formats
+	uint32_t getOutputWidth() const;
+	uint32_t getOutputHeight() const;
+	// Bytes per row of the first plane for the planar formats
+	uint32_t getRowBytes() const { return getOutputWidth() * getOutputBytesPerPixel(); }
+	// Size of the buffer getFrame needs
+	uint32_t getOutputSize() const;
+	// Decimation, decided by the USB thread as each frame starts so that frames nobody is going to read are never
+	// copied into the frame queue. Only every frameInterval-th frame is delivered (1 = all of them). With skipWhenBusy,
+	// frames that start while getFrame hasn't handed back a buffer yet are skipped too, instead of being copied and then
+	// dropped by the drop policy; the consumer then gets the first frame that starts after it is ready again.
+	// Can be changed while streaming.
+	void setDecimation(uint32_t frameInterval, bool skipWhenBusy);
+	uint32_t getDecimationInterval() const;
+	bool getSkipWhenBusy() const;
+
+	uint32_t getQueueDepth() const { return frame_queue_depth; }
+	EDropPolicy getDropPolicy() const { return frame_drop_policy; }
+	uint32_t getTransferCount() const { return transfer_count; }
+	uint32_t getTransferSize() const { return transfer_size; }
+	// Whether the transfers go straight into DMA-able device memory (libusb_dev_mem_alloc) where the platform has it.
+	// On by default; takes effect at the next start(), e.g. to compare the two with ps3eye-bench.
+	void setUseDeviceMemory(bool enable);
+	bool getUseDeviceMemory() const { return use_device_memory; }
+	// Whether the transfers of the current stream actually went into device memory
+	bool isUsingDeviceMemory() const;
+	QueueStats getQueueStats() const;
+	StreamStats getStats() const;
 	uint32_t getOutputBytesPerPixel() const;
 
 	//
 	static const std::vector<PS3EYERef>& getDevices( bool forceRefresh = false );
 
+	// The libusb context the driver runs on. Other USB devices opened on it are served by the same event thread
+	// while a camera is streaming, and their synchronous transfers cooperate with it through libusb's event lock.
+	static libusb_context* getUSBContext();
+
 private:
 	PS3EYECam(const PS3EYECam&);
     void operator=(const PS3EYECam&);
@@ -193,15 +362,24 @@ private:
 	void release();
 
 	// usb ops
+	void select_mode(uint32_t width, uint32_t height);
+	void apply_mode();
+	void restart_stream();
+	void start_stream();
+	bool reconnect();
+	void update_stall_timeout();
 	uint16_t ov534_set_frame_rate(uint16_t frame_rate, bool dry_run = false);
+	void ov534_set_window();
 	void ov534_set_led(int status);
 	void ov534_reg_write(uint16_t reg, uint8_t val);
 	uint8_t ov534_reg_read(uint16_t reg);
 	int sccb_check_status();
 	void sccb_reg_write(uint8_t reg, uint8_t val);
 	uint8_t sccb_reg_read(uint16_t reg);
+	void ov534_reg_write_batch(const uint8_t (*data)[2], int len);
 	void reg_w_array(const uint8_t (*data)[2], int len);
 	void sccb_w_array(const uint8_t (*data)[2], int len);
+	void invalidate_shadows();
 
 	// controls
 	bool autogain;
@@ -219,16 +397,37 @@ private:
     bool flip_v;
 	//
     bool is_streaming;
+	bool stream_lost;				// Torn down after a disconnect, waiting for reconnect
+	bool reconnect_missing;			// The last reconnect attempt didn't find the device, which rate limits the next ones
+	uint32_t reconnect_arrivals;	// USBMgr arrival count at that attempt
+	uint64_t reconnect_time;
+	uint32_t reconnect_count;
+	uint32_t stall_intervals;
+	uint32_t stall_recovery_count;
 
 	std::shared_ptr<class USBMgr> mgrPtr;
 
 	static bool devicesEnumerated;
     static std::vector<PS3EYERef> devices;
 
-	uint32_t frame_width;
+	uint32_t frame_width;		// Active window
 	uint32_t frame_height;
+	uint32_t sensor_width;		// Sensor mode
+	uint32_t sensor_height;
+	uint32_t window_x;
+	uint32_t window_y;
 	uint16_t frame_rate;
 	EOutputFormat frame_output_format;
+	uint32_t frame_queue_depth;
+	EDropPolicy frame_drop_policy;
+	uint32_t transfer_count;
+	uint32_t transfer_size;
+	bool use_device_memory;
+
+	// Last value written to or read from each bridge/sensor register, -1 if unknown. Reads of registers the
+	// hardware doesn't change by itself are served from here, and writes that wouldn't change anything are skipped.
+	int16_t ov534_shadow[256];
+	int16_t sccb_shadow[256];
 
 	//usb stuff
 	libusb_device *device_;